@@ -0,0 +1,153 @@
+/*
+  batcher.cc
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "batcher.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+// Number of recent request latencies used for percentiles
+static const std::size_t kLatencyWindow = 10000;
+
+PredictionBatcher::PredictionBatcher(const Ensemble &ensemble,
+                                     unsigned max_batch_size,
+                                     std::chrono::microseconds max_delay)
+    : ensemble_(ensemble),
+      max_batch_size_(std::max(max_batch_size, 1u)),
+      max_delay_(max_delay),
+      started_(std::chrono::steady_clock::now()),
+      stop_(false),
+      requests_(0),
+      batches_(0),
+      thread_(&PredictionBatcher::BatchLoop, this) {}
+
+PredictionBatcher::~PredictionBatcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  condition_.notify_all();
+  thread_.join();
+}
+
+std::future<std::vector<float>> PredictionBatcher::Submit(
+    std::vector<float> input) {
+  Request request;
+  request.input = std::move(input);
+  request.submitted = std::chrono::steady_clock::now();
+  std::future<std::vector<float>> output = request.output.get_future();
+  
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(request));
+  }
+  condition_.notify_all();
+  
+  return output;
+}
+
+PredictionStats PredictionBatcher::Stats() {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - started_;
+  
+  PredictionStats stats;
+  stats.requests = requests_;
+  stats.batches = batches_;
+  stats.p50_latency_ms = Percentile(latencies_ms_, 0.5);
+  stats.p99_latency_ms = Percentile(latencies_ms_, 0.99);
+  stats.requests_per_second = requests_ / std::max(elapsed.count(), 1e-9);
+  
+  return stats;
+}
+
+void PredictionBatcher::BatchLoop() {
+  const unsigned num_output = ensemble_.NumOutput();
+  std::vector<Request> batch;
+  std::vector<float*> inputs;
+  std::vector<float> outputs;
+  
+  for (;;) {
+    batch.clear();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      
+      // Give concurrent requests a short time to join the batch
+      condition_.wait_until(lock, queue_.front().submitted + max_delay_,
+                            [this]() {
+        return stop_ || queue_.size() >= max_batch_size_;
+      });
+      while (!queue_.empty() && batch.size() < max_batch_size_) {
+        batch.push_back(std::move(queue_.front()));
+        queue_.pop_front();
+      }
+    }
+    
+    inputs.clear();
+    for (Request &request : batch) {
+      inputs.push_back(request.input.data());
+    }
+    outputs.resize(batch.size() * num_output);
+    ensemble_.Predict(inputs.data(), static_cast<unsigned>(batch.size()),
+                      outputs.data());
+    
+    // Counters are updated before results are delivered so they include
+    // every request a caller has received
+    auto completed = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex_);
+      for (Request &request : batch) {
+        std::chrono::duration<double, std::milli> latency =
+            completed - request.submitted;
+        if (latencies_ms_.size() < kLatencyWindow) {
+          latencies_ms_.push_back(latency.count());
+        } else {
+          latencies_ms_[requests_ % kLatencyWindow] = latency.count();
+        }
+        ++requests_;
+      }
+      ++batches_;
+    }
+    
+    for (unsigned request = 0; request < batch.size(); ++request) {
+      batch[request].output.set_value(std::vector<float>(
+          outputs.begin() + request * num_output,
+          outputs.begin() + (request + 1) * num_output));
+    }
+  }
+}
+
+double Percentile(std::vector<double> values, double fraction) {
+  if (values.empty()) {
+    return 0.0;
+  }
+  
+  std::size_t rank = static_cast<std::size_t>(
+      std::ceil(fraction * values.size()));
+  auto position = values.begin() + (rank > 0 ? rank - 1 : 0);
+  std::nth_element(values.begin(), position, values.end());
+  
+  return *position;
+}
@@ -0,0 +1,108 @@
+/*
+  batcher.h
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BATCHER_H_
+#define BATCHER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ensemble.h"
+
+/** Counters describing the predictions made by a ``PredictionBatcher``. */
+struct PredictionStats {
+  unsigned long requests;
+  unsigned long batches;
+  double p50_latency_ms;  // Over the most recent requests
+  double p99_latency_ms;
+  double requests_per_second;  // Since the batcher was created
+};
+
+/**
+  \rst
+  Coalesces prediction requests submitted concurrently into micro-batches
+  evaluated with ``Ensemble::Predict`` on a dedicated thread. A batch is
+  evaluated once it reaches ``max_batch_size`` requests or its oldest request
+  has waited ``max_delay``.
+  
+  ***Example**::
+  
+    PredictionBatcher batcher(ensemble);
+    std::future<std::vector<float>> prediction = batcher.Submit(features);
+    std::vector<float> outputs = prediction.get();
+  \endrst
+*/
+class PredictionBatcher {
+ public:
+  /** Start batching predictions for an ensemble that outlives the batcher. */
+  explicit PredictionBatcher(
+      const Ensemble &ensemble,
+      unsigned max_batch_size = 64,
+      std::chrono::microseconds max_delay = std::chrono::microseconds(500));
+  
+  /** Evaluate outstanding requests and stop the batching thread. */
+  ~PredictionBatcher();
+  
+  PredictionBatcher(const PredictionBatcher&) = delete;
+  PredictionBatcher& operator=(const PredictionBatcher&) = delete;
+  
+  /** Queue a request with ``Ensemble::NumInput`` features. */
+  std::future<std::vector<float>> Submit(std::vector<float> input);
+  
+  /** Counters for the requests completed so far. */
+  PredictionStats Stats();
+  
+ private:
+  struct Request {
+    std::vector<float> input;
+    std::promise<std::vector<float>> output;
+    std::chrono::steady_clock::time_point submitted;
+  };
+  
+  void BatchLoop();
+  
+  const Ensemble &ensemble_;
+  const unsigned max_batch_size_;
+  const std::chrono::microseconds max_delay_;
+  const std::chrono::steady_clock::time_point started_;
+  
+  std::deque<Request> queue_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stop_;
+  
+  // Latencies of the most recent requests in a ring buffer
+  std::vector<double> latencies_ms_;
+  unsigned long requests_;
+  unsigned long batches_;
+  std::mutex stats_mutex_;
+  
+  std::thread thread_;
+};
+
+/** Value at a fraction (between 0 and 1) of the sorted values. */
+double Percentile(std::vector<double> values, double fraction);
+
+#endif // BATCHER_H_
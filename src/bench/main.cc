@@ -0,0 +1,287 @@
+/*
+  main.cc
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fann.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "./../crossvalidate.h"
+#include "./../data.h"
+#include "./../ensemble.h"
+#include "./../fann_types.h"
+#include "./../network.h"
+#include "./../train.h"
+#include "./../trainer.h"
+
+/** Options controlling the size of the synthetic data and the runs. */
+struct BenchOptions {
+  unsigned samples = 1000;
+  unsigned inputs = 16;
+  unsigned hidden = 16;
+  unsigned repetitions = 10;
+  std::string filter;
+};
+
+/**
+  Creates a data set with uniformly random features and a binary label from a
+  noisy linear rule, so stratification splits it into 2 groups.
+*/
+FannTrainData GenerateData(const BenchOptions &options) {
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> feature_dist(-1.0f, 1.0f);
+  std::normal_distribution<float> noise_dist(0.0f, 0.5f);
+  std::vector<float> coefficients(options.inputs);
+  for (float &coefficient : coefficients) {
+    coefficient = feature_dist(rng);
+  }
+  
+  auto data = FannTrainData(fann_create_train(options.samples,
+                                              options.inputs, 1));
+  for (unsigned sample = 0; sample < options.samples; ++sample) {
+    float sum = noise_dist(rng);
+    for (unsigned input = 0; input < options.inputs; ++input) {
+      data->input[sample][input] = feature_dist(rng);
+      sum += coefficients[input] * data->input[sample][input];
+    }
+    data->output[sample][0] = sum >= 0.0f ? 1.0f : 0.0f;
+  }
+  
+  return data;
+}
+
+unsigned LabelHelper(float *input, float *output) {
+  return *output >= 0.5f ? 0 : 1;
+}
+
+/**
+  Times repetitions of a benchmark (after a warm up run) and prints a line of
+  JSON with the distribution of the times. ``items`` is the number of units of
+  work done by each repetition and is used to report throughput.
+*/
+void Measure(const BenchOptions &options,
+             const std::string &name,
+             unsigned long items,
+             const std::function<void()> &benchmark) {
+  if (name.find(options.filter) == std::string::npos) {
+    return;
+  }
+  
+  benchmark();
+  std::vector<double> times;
+  for (unsigned repetition = 0; repetition < options.repetitions;
+       ++repetition) {
+    auto start = std::chrono::steady_clock::now();
+    benchmark();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    times.push_back(elapsed.count());
+  }
+  std::sort(times.begin(), times.end());
+  
+  double mean = 0.0;
+  for (double time : times) {
+    mean += time / times.size();
+  }
+  double median = times[times.size() / 2];
+  std::cout << "{\"benchmark\": \"" << name << "\""
+            << ", \"samples\": " << options.samples
+            << ", \"inputs\": " << options.inputs
+            << ", \"repetitions\": " << times.size()
+            << ", \"min_ms\": " << times.front()
+            << ", \"median_ms\": " << median
+            << ", \"mean_ms\": " << mean
+            << ", \"max_ms\": " << times.back()
+            << ", \"items_per_second\": " << (items / (median / 1000.0))
+            << "}" << std::endl;
+}
+
+/**
+  Microbenchmarks of the main stages of the pipeline on synthetic data, each
+  reported as a line of JSON.
+*/
+int main(int argc, char **argv) {
+  BenchOptions options;
+  for (int arg = 1; arg + 1 < argc; arg += 2) {
+    std::string option = argv[arg];
+    std::string value = argv[arg + 1];
+    if (option == "--samples") {
+      options.samples = static_cast<unsigned>(std::stoul(value));
+    } else if (option == "--inputs") {
+      options.inputs = static_cast<unsigned>(std::stoul(value));
+    } else if (option == "--hidden") {
+      options.hidden = static_cast<unsigned>(std::stoul(value));
+    } else if (option == "--repetitions") {
+      options.repetitions = static_cast<unsigned>(std::stoul(value));
+    } else if (option == "--filter") {
+      options.filter = value;
+    } else {
+      argc = 0;
+    }
+  }
+  if (argc % 2 == 0 || options.samples < 20 || options.inputs == 0 ||
+      options.hidden == 0 || options.repetitions == 0) {
+    std::cout << "Usage: bench [--samples n] [--inputs n] [--hidden n] "
+              << "[--repetitions n] [--filter name]" << std::endl;
+    return 0;
+  }
+  
+  FannTrainData data = GenerateData(options);
+  std::vector<FannTrainData> stratified_data = StratifyTrainData(
+      data, 2, LabelHelper);
+  
+  // Data handling
+  Measure(options, "StratifyTrainData", options.samples, [&]() {
+    StratifyTrainData(data, 2, LabelHelper);
+  });
+  for (CVFoldMode mode : {CVFoldMode::kCopy, CVFoldMode::kView}) {
+    std::string mode_name = mode == CVFoldMode::kView ? "view" : "copy";
+    Measure(options, "CrossValidation/" + mode_name, 10ul * options.samples,
+            [&]() {
+      CrossValidation(stratified_data, [](FannTrainData &training_data,
+                                          FannTrainData &validation_data) {},
+                      10, 1, mode);
+    });
+  }
+  Measure(options, "FoldPlan", 10ul * options.samples, [&]() {
+    FoldPlan plan(stratified_data, 10, 1, 42);
+  });
+  std::vector<std::vector<float>> values = GetTrainDataValues(data);
+  std::vector<std::string> header(options.inputs + 1, "column");
+  static const char *csv_path = "bench.csv";
+  Measure(options, "WriteCsv", options.samples, [&]() {
+    WriteCsv(csv_path, values, header);
+  });
+  std::remove(csv_path);
+  
+  // Training on a fixed split with identical initial weights per algorithm
+  unsigned num_validation = options.samples / 10;
+  auto training_data = FannTrainData(fann_subset_train_data(
+      data.get(), 0, options.samples - num_validation));
+  auto validation_data = FannTrainData(fann_subset_train_data(
+      data.get(), options.samples - num_validation, num_validation));
+  const std::pair<fann_train_enum, const char*> algorithms[] = {
+    {FANN_TRAIN_INCREMENTAL, "incremental"},
+    {FANN_TRAIN_BATCH, "batch"},
+    {FANN_TRAIN_RPROP, "rprop"},
+    {FANN_TRAIN_QUICKPROP, "quickprop"},
+    {FANN_TRAIN_SARPROP, "sarprop"}
+  };
+  for (auto &algorithm : algorithms) {
+    FannNetwork initial_network(fann_create_standard(
+        3, options.inputs, options.hidden, 1));
+    fann_set_training_algorithm(initial_network.get(), algorithm.first);
+    fann_set_activation_function_hidden(initial_network.get(),
+                                        FANN_SIGMOID_SYMMETRIC);
+    std::srand(42);
+    fann_randomize_weights(initial_network.get(), -0.1f, 0.1f);
+    Measure(options, std::string("TrainNetwork/") + algorithm.second,
+            training_data->num_data, [&]() {
+      FannNetwork network(fann_copy(initial_network.get()));
+      TrainNetwork(network, training_data, validation_data);
+    });
+    
+    // Training from random weights and from the weights a network of the
+    // same topology learnt on the same split, as warm starts inherit the
+    // weights learnt on the same fold
+    FannNetwork parent_network(fann_copy(initial_network.get()));
+    TrainNetwork(parent_network, training_data, validation_data);
+    for (bool warm : {false, true}) {
+      FannNetwork &start_network = warm ? parent_network : initial_network;
+      Measure(options, std::string("TrainNetwork/") +
+              (warm ? "warm/" : "cold/") + algorithm.second,
+              training_data->num_data, [&]() {
+        FannNetwork network(fann_copy(initial_network.get()));
+        std::copy(start_network->weights,
+                  start_network->weights + start_network->total_connections,
+                  network->weights);
+        TrainNetwork(network, training_data, validation_data);
+      });
+    }
+    
+    // Single epochs with FANN and the native trainer on the same network
+    FannNetwork fann_network(fann_copy(initial_network.get()));
+    Measure(options, std::string("TrainEpoch/fann/") + algorithm.second,
+            training_data->num_data, [&]() {
+      fann_train_epoch(fann_network.get(), training_data.get());
+    });
+    FannNetwork native_network(fann_copy(initial_network.get()));
+    NativeTrainer trainer(native_network);
+    Measure(options, std::string("TrainEpoch/native/") + algorithm.second,
+            training_data->num_data, [&]() {
+      trainer.TrainEpoch(training_data);
+    });
+  }
+  
+  // Inference with an ensemble of 10 networks in each storage layout
+  for (EnsembleStorage storage : {EnsembleStorage::kSeparate,
+                                  EnsembleStorage::kPacked}) {
+    std::string storage_name = storage == EnsembleStorage::kPacked
+        ? "packed" : "separate";
+    Ensemble ensemble(storage);
+    std::srand(42);
+    for (int member = 0; member < 10; ++member) {
+      FannNetwork network(fann_create_standard(
+          3, options.inputs, options.hidden, 1));
+      fann_randomize_weights(network.get(), -1.0f, 1.0f);
+      ensemble.Add(std::move(network));
+    }
+    Measure(options, "Ensemble::Run/" + storage_name, options.samples, [&]() {
+      for (unsigned sample = 0; sample < options.samples; ++sample) {
+        ensemble.Run(data->input[sample]);
+      }
+    });
+    std::vector<float> predictions(options.samples);
+    Measure(options, "Ensemble::Predict/" + storage_name, options.samples,
+            [&]() {
+      ensemble.Predict(data->input, options.samples, predictions.data());
+    });
+  }
+  
+  // Breeding operators
+  const unsigned num_operations = 1000;
+  std::vector<FannNetworkDescriptor> descriptors;
+  for (unsigned descriptor = 0; descriptor < 10; ++descriptor) {
+    descriptors.emplace_back(options.inputs, 1);
+    descriptors.back().Mutate(1.0f, 0.5f, 1.0f);
+  }
+  Measure(options, "FannNetworkDescriptor::Merge", num_operations, [&]() {
+    for (unsigned operation = 0; operation < num_operations; ++operation) {
+      FannNetworkDescriptor descriptor = descriptors[operation % 10];
+      descriptor.Merge(descriptors[(operation + 1) % 10]);
+    }
+  });
+  Measure(options, "FannNetworkDescriptor::Mutate", num_operations, [&]() {
+    for (unsigned operation = 0; operation < num_operations; ++operation) {
+      FannNetworkDescriptor descriptor = descriptors[operation % 10];
+      descriptor.Mutate(0.25f, 0.1f, 0.5f);
+    }
+  });
+  
+  return 0;
+}
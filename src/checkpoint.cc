@@ -0,0 +1,261 @@
+/*
+  checkpoint.cc
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "checkpoint.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+
+#include "config.h"
+
+static const char kCheckpointMagic[4] = {'G', 'B', 'M', 'C'};
+static const std::uint32_t kCheckpointVersion = 4;
+
+// Upper bound on the size of a saved random number generator state
+static const std::uint32_t kMaxRngStateSize = 1 << 16;
+
+// Upper bound on the size of a saved input file path
+static const std::uint32_t kMaxFilePathSize = 1 << 16;
+
+// Returns the 64-bit FNV-1a hash of the shape and every value of a data set
+static std::uint64_t HashTrainData(const fann_train_data *data) {
+  std::uint64_t hash = 14695981039346656037ull;
+  auto hash_bytes = [&hash](const void *bytes, std::size_t size) {
+    for (std::size_t byte = 0; byte < size; ++byte) {
+      hash ^= static_cast<const unsigned char*>(bytes)[byte];
+      hash *= 1099511628211ull;
+    }
+  };
+  hash_bytes(&data->num_data, sizeof(data->num_data));
+  hash_bytes(&data->num_input, sizeof(data->num_input));
+  hash_bytes(&data->num_output, sizeof(data->num_output));
+  for (unsigned sample = 0; sample < data->num_data; ++sample) {
+    hash_bytes(data->input[sample], data->num_input * sizeof(fann_type));
+    hash_bytes(data->output[sample], data->num_output * sizeof(fann_type));
+  }
+  
+  return hash;
+}
+
+Checkpoint::Checkpoint(std::string path,
+                       const FannTrainData &data,
+                       std::vector<std::string> file_paths)
+    : path_(path),
+      num_samples_(fann_length_train_data(data.get())),
+      data_hash_(HashTrainData(data.get())),
+      file_paths_(std::move(file_paths)),
+      seed_(0) {
+  if (!Load()) {
+    completed_runs_.clear();
+    evolution_states_.clear();
+    do {
+      seed_ = std::random_device{}();
+    } while (seed_ == 0);  // Zero selects unseeded shuffles
+  }
+}
+
+unsigned Checkpoint::Seed() const {
+  return seed_;
+}
+
+bool Checkpoint::IsRunComplete(int run) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return completed_runs_.count(run) > 0;
+}
+
+void Checkpoint::CompleteRun(int run) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  completed_runs_.insert(run);
+  evolution_states_.erase(run);
+  Save();
+}
+
+bool Checkpoint::GetEvolutionState(int run, EvolutionState &state) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto saved_state = evolution_states_.find(run);
+  if (saved_state == evolution_states_.end()) {
+    return false;
+  }
+  state = saved_state->second;
+  
+  return true;
+}
+
+void Checkpoint::SetEvolutionState(int run, const EvolutionState &state) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  evolution_states_[run] = state;
+  Save();
+}
+
+void Checkpoint::Remove() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::remove(path_.c_str());
+}
+
+bool Checkpoint::Load() {
+  std::ifstream file(path_, std::ifstream::binary);
+  auto read = [&](auto &value) {
+    file.read(reinterpret_cast<char*>(&value), sizeof(value));
+  };
+  
+  char magic[sizeof(kCheckpointMagic)] = {};
+  std::uint32_t version = 0;
+  std::uint32_t num_samples = 0;
+  std::uint64_t data_hash = 0;
+  std::int32_t outer_folds = 0;
+  std::int32_t outer_repeats = 0;
+  read(magic);
+  read(version);
+  read(num_samples);
+  read(data_hash);
+  read(outer_folds);
+  read(outer_repeats);
+  if (!file ||
+      std::memcmp(magic, kCheckpointMagic, sizeof(magic)) != 0 ||
+      version != kCheckpointVersion ||
+      num_samples != num_samples_ ||
+      data_hash != data_hash_ ||
+      outer_folds != kCrossValidationOuterFolds ||
+      outer_repeats != kCrossValidationOuterRepeats) {
+    return false;
+  }
+  
+  // The same samples loaded from other files are a different data set
+  std::uint32_t num_file_paths = 0;
+  read(num_file_paths);
+  if (!file || num_file_paths != file_paths_.size()) {
+    return false;
+  }
+  for (const std::string &file_path : file_paths_) {
+    std::uint32_t file_path_size = 0;
+    read(file_path_size);
+    if (!file || file_path_size != file_path.size() ||
+        file_path_size > kMaxFilePathSize) {
+      return false;
+    }
+    std::string saved_file_path(file_path_size, '\0');
+    file.read(&saved_file_path[0], saved_file_path.size());
+    if (!file || saved_file_path != file_path) {
+      return false;
+    }
+  }
+  read(seed_);
+  
+  std::uint32_t num_completed_runs = 0;
+  read(num_completed_runs);
+  for (std::uint32_t index = 0; index < num_completed_runs && file; ++index) {
+    std::int32_t run = 0;
+    read(run);
+    completed_runs_.insert(run);
+  }
+  
+  std::uint32_t num_states = 0;
+  read(num_states);
+  for (std::uint32_t index = 0; index < num_states && file; ++index) {
+    std::int32_t run = 0;
+    std::uint32_t rng_state_size = 0;
+    std::uint32_t num_descriptors = 0;
+    EvolutionState state;
+    read(run);
+    read(state.generation);
+    read(state.best_ever_score);
+    read(state.plan_seed);
+    read(rng_state_size);
+    if (rng_state_size > kMaxRngStateSize) {
+      return false;
+    }
+    state.rng_state.resize(file ? rng_state_size : 0);
+    file.read(&state.rng_state[0], state.rng_state.size());
+    read(num_descriptors);
+    for (std::uint32_t descriptor = 0;
+         descriptor < num_descriptors && file; ++descriptor) {
+      std::uint8_t complete = 0;
+      state.scored_descriptors.emplace_back();
+      if (!state.scored_descriptors.back().first.Deserialize(file)) {
+        return false;
+      }
+      read(state.scored_descriptors.back().second);
+      read(complete);
+      state.complete_scores.push_back(complete != 0);
+    }
+    evolution_states_[run] = std::move(state);
+  }
+  
+  return static_cast<bool>(file);
+}
+
+void Checkpoint::Save() {
+  
+  // Write to a temporary file then rename so an interrupted write never
+  // replaces the previous checkpoint
+  std::string temporary_path = path_ + ".tmp";
+  {
+    std::ofstream file(temporary_path,
+                       std::ofstream::binary|std::ofstream::trunc);
+    auto write = [&](const auto &value) {
+      file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    
+    write(kCheckpointMagic);
+    write(kCheckpointVersion);
+    write(static_cast<std::uint32_t>(num_samples_));
+    write(data_hash_);
+    write(static_cast<std::int32_t>(kCrossValidationOuterFolds));
+    write(static_cast<std::int32_t>(kCrossValidationOuterRepeats));
+    write(static_cast<std::uint32_t>(file_paths_.size()));
+    for (const std::string &file_path : file_paths_) {
+      write(static_cast<std::uint32_t>(file_path.size()));
+      file.write(file_path.data(), file_path.size());
+    }
+    write(seed_);
+    
+    write(static_cast<std::uint32_t>(completed_runs_.size()));
+    for (int run : completed_runs_) {
+      write(static_cast<std::int32_t>(run));
+    }
+    
+    write(static_cast<std::uint32_t>(evolution_states_.size()));
+    for (auto &run_state : evolution_states_) {
+      const EvolutionState &state = run_state.second;
+      write(static_cast<std::int32_t>(run_state.first));
+      write(state.generation);
+      write(state.best_ever_score);
+      write(state.plan_seed);
+      write(static_cast<std::uint32_t>(state.rng_state.size()));
+      file.write(state.rng_state.data(), state.rng_state.size());
+      write(static_cast<std::uint32_t>(state.scored_descriptors.size()));
+      for (std::size_t descriptor = 0;
+           descriptor < state.scored_descriptors.size(); ++descriptor) {
+        state.scored_descriptors[descriptor].first.Serialize(file);
+        write(state.scored_descriptors[descriptor].second);
+        write(static_cast<std::uint8_t>(state.complete_scores[descriptor]));
+      }
+    }
+    
+    if (!file.flush()) {
+      return;
+    }
+  }
+  std::rename(temporary_path.c_str(), path_.c_str());
+}
@@ -0,0 +1,92 @@
+/*
+  checkpoint.h
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "evolve.h"
+#include "fann_types.h"
+
+/**
+  \rst
+  Progress of the outer cross validation runs saved to disk so an interrupted
+  pipeline can be resumed. Records the seed of the outer cross validation (so
+  restarted runs use the same folds), which runs have completed and the
+  ``EvolutionState`` of runs still in progress. Every update rewrites the file
+  atomically. A file written for different data (compared by a hash of every
+  sample and the list of input files) or outer cross validation configuration
+  is ignored.
+  
+  ***Example**::
+  
+    Checkpoint checkpoint("models/checkpoint.bin", data, file_paths);
+    if (!checkpoint.IsRunComplete(run)) {
+      // Perform the run then record it
+      checkpoint.CompleteRun(run);
+    }
+  \endrst
+*/
+class Checkpoint {
+ public:
+  /** Open a checkpoint file, loading any progress it holds for ``data``. */
+  Checkpoint(std::string path,
+             const FannTrainData &data,
+             std::vector<std::string> file_paths);
+  
+  /** Seed for the outer cross validation shuffles. */
+  unsigned Seed() const;
+  
+  /** Whether a run has completed. */
+  bool IsRunComplete(int run);
+  
+  /** Record a run as complete, discarding its evolution state. */
+  void CompleteRun(int run);
+  
+  /** Get the saved evolution state of a run, returning false if none. */
+  bool GetEvolutionState(int run, EvolutionState &state);
+  
+  /** Save the evolution state of a run in progress. */
+  void SetEvolutionState(int run, const EvolutionState &state);
+  
+  /** Delete the checkpoint file once the pipeline has finished. */
+  void Remove();
+  
+ private:
+  bool Load();
+  void Save();
+  
+  std::string path_;
+  unsigned num_samples_;
+  std::uint64_t data_hash_;
+  std::vector<std::string> file_paths_;
+  unsigned seed_;
+  std::set<int> completed_runs_;
+  std::map<int, EvolutionState> evolution_states_;
+  std::mutex mutex_;
+};
+
+#endif // CHECKPOINT_H_
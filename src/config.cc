@@ -24,6 +24,7 @@ const int kCrossValidationOuterFolds = 10;
 const int kCrossValidationInnerFolds = 10;
 const int kCrossValidationOuterRepeats = 10;
 const int kCrossValidationInnerRepeats = 100;
+const int kCrossValidationOuterConcurrency = 4;
 
 const int kNetworksPerGeneration = 100;
 const int kNetworksMatingPerGeneration = 10;
@@ -32,7 +33,17 @@ const float kBigMutationStartChance = 1.0f;
 const float kBigMutationEndChance = 0.05f;
 const float kBigMutationCoefficient = 0.85f;
 
+const bool kRacingEnabled = false;
+const int kRacingRepeatsPerRound = 10;
+const float kRacingConfidence = 3.0f;
+
+const bool kWarmStartEnabled = false;
+
 const int kTrainMaxEpochs = 100;
 const int kTrainEarlyStoppingCount = 5;
+const bool kTrainNative = true;
+const int kTrainParallelSamples = 2048;
 
 const int kEnsembleSize = 100;
+const int kEnsemblePrunedSize = kEnsembleSize;
+const float kEnsemblePruningTolerance = 0.01f;
@@ -29,6 +29,8 @@ extern const int kCrossValidationInnerFolds;
 extern const int kCrossValidationOuterRepeats;
 /** Number of repeats in inner cross validation loop. */
 extern const int kCrossValidationInnerRepeats;
+/** Number of outer cross validation runs performed concurrently. */
+extern const int kCrossValidationOuterConcurrency;
 
 /** Size of the population of network descriptors for each generation. */
 extern const int kNetworksPerGeneration;
@@ -43,12 +45,37 @@ extern const float kBigMutationEndChance;
 /** Exponentional coefficient used to anneal initial to final mutation rate. */
 extern const float kBigMutationCoefficient;
 
+/**
+  Evaluate inner cross validation repeats in rounds, dropping descriptors that
+  cannot reach the fittest network descriptors bred each generation. Off by
+  default as its effect on the selected descriptors has not been measured.
+*/
+extern const bool kRacingEnabled;
+/** Number of inner cross validation repeats evaluated per racing round. */
+extern const int kRacingRepeatsPerRound;
+/** Standard errors of the mean error used for racing confidence bounds. */
+extern const float kRacingConfidence;
+
+/**
+  Start each fold of a descriptor from the weights a parent with the same
+  layers learnt on the same fold of the inner cross validation plan.
+*/
+extern const bool kWarmStartEnabled;
+
 /** Maximum number of EPOCH. */
 extern const int kTrainMaxEpochs;
 /** Stop after number of EPOCH without improvement to error. */
 extern const int kTrainEarlyStoppingCount;
+/** Train with ``NativeTrainer`` rather than ``fann_train_epoch``. */
+extern const bool kTrainNative;
+/** Minimum number of samples evaluated by each task of a parallel epoch. */
+extern const int kTrainParallelSamples;
 
 /** Size of final ensemble in multiples of 10. */
 extern const int kEnsembleSize;
+/** Most repeats kept by pruning (``kEnsembleSize`` disables pruning). */
+extern const int kEnsemblePrunedSize;
+/** Relative increase in out-of-fold error accepted when pruning the ensemble. */
+extern const float kEnsemblePruningTolerance;
 
 #endif // CONFIG_H_
@@ -23,11 +23,24 @@
 
 #include <algorithm>
 #include <cmath>
+#include <iterator>
+#include <random>
 
 #include "fann_extension.h"
+#include "profile.h"
+
+// Unseeded fold views are shuffled with a generator owned by each thread so
+// concurrent cross validations over shared strata never contend on rand
+thread_local static std::mt19937 view_rng{std::random_device{}()};
 
 void CrossValidation(std::vector<FannTrainData> &data,
-                     const CVFuncExt& process_data, int folds, int repeats) {
+                     const CVFuncExt& process_data, int folds, int repeats,
+                     CVFoldMode mode, unsigned seed) {
+  
+  const bool view = mode == CVFoldMode::kView;
+  
+  // Fold construction is timed separately from processing the folds
+  PROFILE_TIMER(setup_timer, ProfilePhase::kFoldConstruction);
   
   // Calculate number of samples needed per strata for a given fold
   unsigned total_samples = 0;
@@ -43,58 +56,118 @@ void CrossValidation(std::vector<FannTrainData> &data,
                            std::placeholders::_1,
                            static_cast<float>(folds)));
   
-  // Allocate memory to hold samples for each folds
+  // Allocate memory to hold samples (or references to samples) for each folds
   unsigned num_input = fann_num_input_train_data(data.back().get());
   unsigned num_output = fann_num_output_train_data(data.back().get());
+  auto create_train_data = [&](unsigned num_data) {
+    if (view) {
+      return FannTrainData(fann_create_train_view(num_data,
+                                                  num_input,
+                                                  num_output),
+                           TrainDataDeleter{true});
+    }
+    return FannTrainData(fann_create_train(num_data, num_input, num_output));
+  };
+  auto set_train_data = [&](FannTrainData &train_data, unsigned position,
+                            fann_type *input, fann_type *output) {
+    if (view) {
+      fann_set_train_view(train_data.get(), position, input, output);
+    } else {
+      fann_set_train_data(train_data.get(), position, input, output);
+    }
+  };
+  std::mt19937 seeded_rng(seed);
+  std::mt19937 &rng = seed != 0 ? seeded_rng : view_rng;
+  auto shuffle_train_data = [&](FannTrainData &train_data) {
+    if (seed != 0 || view) {
+      unsigned num_samples = fann_length_train_data(train_data.get());
+      for (unsigned sample = num_samples; sample > 1; --sample) {
+        unsigned swap = std::uniform_int_distribution<unsigned>(
+            0, sample - 1)(rng);
+        if (view) {
+          std::swap(train_data->input[sample - 1], train_data->input[swap]);
+          std::swap(train_data->output[sample - 1], train_data->output[swap]);
+        } else {
+          std::swap_ranges(train_data->input[sample - 1],
+                           train_data->input[sample - 1] + num_input,
+                           train_data->input[swap]);
+          std::swap_ranges(train_data->output[sample - 1],
+                           train_data->output[sample - 1] + num_output,
+                           train_data->output[swap]);
+        }
+      }
+    } else {
+      fann_shuffle_train_data(train_data.get());
+    }
+  };
+  
   float fold_size = std::floor(static_cast<float>(total_samples) / folds);
   unsigned max_fold_size = static_cast<unsigned>(fold_size) + folds;
   std::vector<FannTrainData> folds_data;
   folds_data.reserve(folds);
   for (int fold = 0; fold < folds; ++fold) {
-    folds_data.emplace_back(FannTrainData(fann_create_train(max_fold_size,
-                                                            num_input,
-                                                            num_output)));
+    folds_data.emplace_back(create_train_data(max_fold_size));
   }
   
-  auto training_data = FannTrainData(fann_create_train(total_samples,
-                                                       num_input,
-                                                       num_output));
+  auto training_data = create_train_data(total_samples);
+  
+  // In view mode shuffling permutes references to the strata samples so the
+  // caller's data is never reordered
+  std::vector<FannTrainData> strata_views;
+  if (view) {
+    strata_views.reserve(data.size());
+    for (FannTrainData &data_stratum : data) {
+      unsigned num_samples = fann_length_train_data(data_stratum.get());
+      strata_views.emplace_back(create_train_data(num_samples));
+      for (unsigned sample = 0; sample < num_samples; ++sample) {
+        set_train_data(strata_views.back(), sample,
+                       fann_get_train_input(data_stratum.get(), sample),
+                       fann_get_train_output(data_stratum.get(), sample));
+      }
+    }
+  }
+  std::vector<FannTrainData> &strata = view ? strata_views : data;
+  PROFILE_STOP(setup_timer);
   
   for (int repeat = 0; repeat < repeats; ++repeat) {
+    PROFILE_TIMER(repeat_timer, ProfilePhase::kFoldConstruction);
     
     // Shuffle each strata
-    for (FannTrainData &data_stratum : data) {
-      fann_shuffle_train_data(data_stratum.get());
+    for (FannTrainData &data_stratum : strata) {
+      shuffle_train_data(data_stratum);
     }
     
     // Generate folds using shuffled samples for each strata
-    std::vector<int> stratum_sample(data.size(), 0);
-    std::vector<float> stratum_remainder(data.size(), 0);
+    std::vector<int> stratum_sample(strata.size(), 0);
+    std::vector<float> stratum_remainder(strata.size(), 0);
     for (int fold = 0; fold < folds; ++fold) {
       unsigned fold_sample_position = 0;
-      for (unsigned stratum = 0; stratum < data.size(); ++stratum) {
+      for (unsigned stratum = 0; stratum < strata.size(); ++stratum) {
         float current_size = stratum_remainder[stratum] + proportions[stratum];
         current_size = std::round(current_size);
         stratum_remainder[stratum] += (proportions[stratum] - current_size);
         unsigned num_samples = static_cast<unsigned>(current_size);
         for (unsigned sample = 0; sample < num_samples; ++sample) {
-          fann_set_train_data(
-              folds_data[fold].get(),
+          set_train_data(
+              folds_data[fold],
               fold_sample_position,
-              fann_get_train_input(data[stratum].get(),
+              fann_get_train_input(strata[stratum].get(),
                                    stratum_sample[stratum]),
-              fann_get_train_output(data[stratum].get(),
+              fann_get_train_output(strata[stratum].get(),
                                     stratum_sample[stratum]));
           ++fold_sample_position;
           ++stratum_sample[stratum];
         }
       }
       folds_data[fold]->num_data = fold_sample_position;
-      fann_shuffle_train_data(folds_data[fold].get());
+      shuffle_train_data(folds_data[fold]);
     }
+    PROFILE_COUNT(ProfileCounter::kFoldSamples, total_samples);
+    PROFILE_STOP(repeat_timer);
     
     // Merge folds and process
     for (int fold = 0; fold < folds; ++fold) {
+      PROFILE_TIMER(merge_timer, ProfilePhase::kFoldConstruction);
       unsigned fold_samples = fann_length_train_data(folds_data[fold].get());
       unsigned training_data_size = total_samples - fold_samples;
       training_data->num_data = training_data_size;
@@ -105,14 +178,16 @@ void CrossValidation(std::vector<FannTrainData> &data,
         unsigned fold_to_copy_samples = fann_length_train_data(
             folds_data[fold_to_copy].get());
         for (unsigned sample = 0; sample < fold_to_copy_samples; ++sample) {
-          fann_set_train_data(
-              training_data.get(),
+          set_train_data(
+              training_data,
               fold_sample_position,
               fann_get_train_input(folds_data[fold_to_copy].get(), sample),
               fann_get_train_output(folds_data[fold_to_copy].get(), sample));
           ++fold_sample_position;
         }
       }
+      PROFILE_COUNT(ProfileCounter::kFoldSamples, training_data_size);
+      PROFILE_STOP(merge_timer);
       
       process_data(training_data, folds_data[fold], fold, repeat);
     }
@@ -122,7 +197,8 @@ void CrossValidation(std::vector<FannTrainData> &data,
 }
 
 void CrossValidation(std::vector<FannTrainData> &data,
-                     const CVFunc& process_data, int folds, int repeats) {
+                     const CVFunc& process_data, int folds, int repeats,
+                     CVFoldMode mode, unsigned seed) {
   
   CrossValidation(
       data,
@@ -131,5 +207,60 @@ void CrossValidation(std::vector<FannTrainData> &data,
         process_data(training_data, validation_data);
       },
       folds,
-      repeats);
+      repeats,
+      mode,
+      seed);
+}
+
+FoldPlan::FoldPlan(std::vector<FannTrainData> &data, int folds, int repeats,
+                   unsigned seed)
+    : folds_(folds),
+      repeats_(repeats),
+      inputs_(repeats),
+      outputs_(repeats),
+      training_(repeats),
+      validation_(repeats) {
+  
+  // Record the rows of each validation fold in the order they are drawn
+  std::vector<std::vector<unsigned>> fold_sizes(repeats);
+  CrossValidation(data, [&](FannTrainData &training_data,
+                            FannTrainData &validation_data,
+                            int fold, int repeat) {
+    unsigned num_samples = fann_length_train_data(validation_data.get());
+    inputs_[repeat].insert(inputs_[repeat].end(), validation_data->input,
+                           validation_data->input + num_samples);
+    outputs_[repeat].insert(outputs_[repeat].end(), validation_data->output,
+                            validation_data->output + num_samples);
+    fold_sizes[repeat].push_back(num_samples);
+  }, folds, repeats, CVFoldMode::kView, seed);
+  
+  // Repeating the rows makes the training set of every fold contiguous
+  PROFILE_SCOPE(ProfilePhase::kFoldConstruction);
+  unsigned num_input = fann_num_input_train_data(data.back().get());
+  unsigned num_output = fann_num_output_train_data(data.back().get());
+  auto create_window = [&](int repeat, unsigned first, unsigned num_data) {
+    return FannTrainData(
+        fann_create_train_window(inputs_[repeat].data() + first,
+                                 outputs_[repeat].data() + first,
+                                 num_data, num_input, num_output),
+        TrainDataDeleter{false, nullptr, true});
+  };
+  for (int repeat = 0; repeat < repeats; ++repeat) {
+    unsigned total_samples = static_cast<unsigned>(inputs_[repeat].size());
+    inputs_[repeat].reserve(2 * total_samples);
+    outputs_[repeat].reserve(2 * total_samples);
+    std::copy_n(inputs_[repeat].begin(), total_samples,
+                std::back_inserter(inputs_[repeat]));
+    std::copy_n(outputs_[repeat].begin(), total_samples,
+                std::back_inserter(outputs_[repeat]));
+    
+    unsigned first = 0;
+    for (int fold = 0; fold < folds; ++fold) {
+      unsigned fold_size = fold_sizes[repeat][fold];
+      validation_[repeat].push_back(create_window(repeat, first, fold_size));
+      training_[repeat].push_back(create_window(
+          repeat, first + fold_size, total_samples - fold_size));
+      first += fold_size;
+    }
+  }
 }
@@ -23,17 +23,42 @@
 
 #include <vector>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
 
 #include "fann_types.h"
+#include "threadpool.h"
 
 using CVFunc = std::function<void(FannTrainData&, FannTrainData&)>;
 using CVFuncExt = std::function<void(FannTrainData&, FannTrainData&, int, int)>;
 
+/** Determines how cross validation assembles training and validation sets. */
+enum class CVFoldMode {
+  /** Copy samples into buffers owned by the cross validation. */
+  kCopy,
+  /**
+    Reference samples in the supplied strata by permuting row pointers. The
+    strata are neither copied nor reordered, and the data passed to
+    ``process_data`` is only valid for the duration of the call. Rows of a
+    view are not contiguous, so FANN functions that copy from ``input[0]``
+    (``fann_duplicate_train_data``, ``fann_subset_train_data`` and
+    ``fann_merge_train_data``) must not be given one; copy it with
+    ``fann_duplicate_train_view`` instead.
+  */
+  kView,
+};
+
 /**
   \rst
   Performs stratified k-fold repeated cross validation. The ``process_data``
   function is called for each round with relevant data and optionally the
-  current fold and repeat.
+  current fold and repeat. The ``mode`` selects whether samples are copied into
+  the training and validation sets or referenced in place. Samples are shuffled
+  with ``rand`` unless a non-zero ``seed`` is supplied, in which case the folds
+  are reproducible for the same data. Unseeded views are shuffled with a
+  generator local to the calling thread, so any number of threads can run
+  cross validations of the same strata at once without copying or locking.
 
   ***Example**::
 
@@ -42,15 +67,158 @@ using CVFuncExt = std::function<void(FannTrainData&, FannTrainData&, int, int)>;
                        int fold, int repeat) {
       // Develop a model on training set and evaluate on held out
       // validation set
-    }, 10, 2);
+    }, 10, 2, CVFoldMode::kView);
   \endrst
 */
 void CrossValidation(std::vector<FannTrainData> &data,
-                     const CVFuncExt& process_data, int folds, int repeats = 1);
+                     const CVFuncExt& process_data, int folds, int repeats = 1,
+                     CVFoldMode mode = CVFoldMode::kCopy, unsigned seed = 0);
 
 /** \cond PRIVATE */
 void CrossValidation(std::vector<FannTrainData> &data,
-                     const CVFunc& process_data, int folds, int repeats = 1);
+                     const CVFunc& process_data, int folds, int repeats = 1,
+                     CVFoldMode mode = CVFoldMode::kCopy, unsigned seed = 0);
 /** \endcond */
 
+/**
+  \rst
+  Stratified folds of repeated cross validation drawn once from the supplied
+  strata (as ``CrossValidation`` would draw them for the same ``seed``) so
+  several models can be evaluated against exactly the same partitions. The
+  training and validation sets are views of the strata which must outlive the
+  plan, and are copied with ``fann_duplicate_train_view`` as for
+  ``CVFoldMode::kView``. Nothing modifies the plan once constructed, so any
+  number of threads can read it at once.
+  
+  The samples of each repeat are stored once, ordered fold by fold, and
+  repeated so that every training set is a window of consecutive rows
+  starting after its validation fold. Training sets therefore hold the folds
+  in rotated order (i.e. the folds after the validation fold come first).
+  
+  ***Example**::
+  
+    FoldPlan plan(data, 10, 100, seed);
+    for (int repeat = 0; repeat < plan.Repeats(); ++repeat) {
+      for (int fold = 0; fold < plan.Folds(); ++fold) {
+        TrainNetwork(network, plan.Training(repeat)[fold],
+                     plan.Validation(repeat)[fold]);
+      }
+    }
+  \endrst
+*/
+class FoldPlan {
+ public:
+  FoldPlan(std::vector<FannTrainData> &data, int folds, int repeats,
+           unsigned seed);
+  
+  FoldPlan(const FoldPlan&) = delete;
+  FoldPlan& operator=(const FoldPlan&) = delete;
+  
+  /** Returns the number of folds in each repeat. */
+  int Folds() const { return folds_; }
+  
+  /** Returns the number of repeats in the plan. */
+  int Repeats() const { return repeats_; }
+  
+  /** Returns the training set of each fold of a repeat. */
+  std::vector<FannTrainData> &Training(int repeat) {
+    return training_[repeat];
+  }
+  
+  /** Returns the validation set of each fold of a repeat. */
+  std::vector<FannTrainData> &Validation(int repeat) {
+    return validation_[repeat];
+  }
+  
+ private:
+  int folds_;
+  int repeats_;
+  std::vector<std::vector<fann_type*>> inputs_;  // Rows of each repeat, twice
+  std::vector<std::vector<fann_type*>> outputs_;
+  std::vector<std::vector<FannTrainData>> training_;
+  std::vector<std::vector<FannTrainData>> validation_;
+};
+
+/**
+  \rst
+  Performs stratified k-fold repeated cross validation with the folds of a
+  ``FoldPlan``, calling ``process_data`` for every fold of every repeat as a
+  separate task on the shared ``ThreadPool`` (for ``MULTITHREAD`` builds).
+  Each call receives training and validation views of its own, which
+  reference the strata and must not modify them. The value returned by each
+  call is passed to ``consume_result`` in order of repeat and then fold as
+  soon as every earlier result has been consumed, so results do not depend on
+  the order in which tasks complete and are not all held at once. Calls to
+  ``consume_result`` never overlap but may be made from any thread.
+  
+  ***Example**::
+  
+    Ensemble ensemble(EnsembleStorage::kPacked);
+    ParallelCrossValidation(data,
+        [&](FannTrainData &training, FannTrainData &validation,
+            int fold, int repeat) {
+      FannNetwork network = descriptor.CreateNetwork();
+      TrainNetwork(network, training, validation);
+      return network;
+    }, [&](FannNetwork network, int fold, int repeat) {
+      ensemble.Add(std::move(network));
+    }, 10, 2);
+  \endrst
+*/
+template <typename Func, typename Consumer>
+void ParallelCrossValidation(std::vector<FannTrainData> &data,
+                             Func process_data,
+                             Consumer consume_result,
+                             int folds,
+                             int repeats = 1,
+                             unsigned seed = 0) {
+  
+  FoldPlan plan(data, folds, repeats, seed);
+#ifdef MULTITHREAD
+  // Results completed ahead of an earlier one wait in their slot. Whichever
+  // task finds the next result ready consumes every consecutive result.
+  using Result = std::result_of_t<Func&(FannTrainData&, FannTrainData&,
+                                        int, int)>;
+  std::vector<std::unique_ptr<Result>> results(folds * repeats);
+  std::mutex results_mutex;
+  int next_result = 0;
+  bool consuming = false;
+  TaskGroup tasks;
+  for (int repeat = 0; repeat < repeats; ++repeat) {
+    for (int fold = 0; fold < folds; ++fold) {
+      tasks.Run([&, fold, repeat]() {
+        std::unique_ptr<Result> result(new Result(process_data(
+            plan.Training(repeat)[fold], plan.Validation(repeat)[fold],
+            fold, repeat)));
+        std::unique_lock<std::mutex> lock(results_mutex);
+        results[repeat * folds + fold] = std::move(result);
+        if (consuming) {
+          return;
+        }
+        consuming = true;
+        while (next_result < folds * repeats && results[next_result]) {
+          std::unique_ptr<Result> ready = std::move(results[next_result]);
+          int index = next_result++;
+          lock.unlock();
+          consume_result(std::move(*ready), index % folds, index / folds);
+          ready.reset();
+          lock.lock();
+        }
+        consuming = false;
+      });
+    }
+  }
+  tasks.Wait();
+#else
+  for (int repeat = 0; repeat < repeats; ++repeat) {
+    for (int fold = 0; fold < folds; ++fold) {
+      consume_result(process_data(plan.Training(repeat)[fold],
+                                  plan.Validation(repeat)[fold],
+                                  fold, repeat),
+                     fold, repeat);
+    }
+  }
+#endif
+}
+
 #endif // CROSSVALIDATE_H_
@@ -21,28 +21,291 @@
 #include "data.h"
 
 #include <fann.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <memory>
 
 #include "fann_extension.h"
+#include "profile.h"
+#include "threadpool.h"
 
-FannTrainData LoadTrainData(std::vector<std::string> files) {
-  FannTrainData data;
+// Header of binary data set files, followed by all inputs then all outputs
+struct BinaryTrainDataHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t num_data;
+  std::uint32_t num_input;
+  std::uint32_t num_output;
+  std::uint32_t reserved[3];
+};
+
+static const char kBinaryTrainDataMagic[4] = {'G', 'B', 'M', 'D'};
+static const std::uint32_t kBinaryTrainDataVersion = 1;
+
+/** Whether a file starts with the binary data set magic. */
+static bool IsBinaryTrainData(const std::string &path) {
+  char magic[sizeof(kBinaryTrainDataMagic)] = {};
+  std::ifstream file(path, std::ifstream::binary);
+  file.read(magic, sizeof(magic));
+  
+  return file && std::memcmp(magic, kBinaryTrainDataMagic,
+                             sizeof(magic)) == 0;
+}
+
+std::shared_ptr<void> MapFile(const std::string &path, std::size_t &length) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  length = static_cast<std::size_t>(file_stat.st_size);
+  void *address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    return nullptr;
+  }
+  
+  std::size_t mapped_length = length;
+  return std::shared_ptr<void>(address, [mapped_length](void *address) {
+    munmap(address, mapped_length);
+  });
+}
+
+/**
+  Maps a binary data set file into memory and returns a view of its samples.
+  The mapping is read-only and shared with other processes mapping the same
+  file, so writing to a sample faults.
+*/
+static FannTrainData MapBinaryTrainData(const std::string &path) {
+  std::size_t length = 0;
+  std::shared_ptr<void> mapping = MapFile(path, length);
+  if (!mapping || length < sizeof(BinaryTrainDataHeader)) {
+    return FannTrainData();
+  }
+  const void *address = mapping.get();
+  
+  auto header = static_cast<const BinaryTrainDataHeader*>(address);
+  std::size_t num_values = static_cast<std::size_t>(header->num_data) *
+      (header->num_input + header->num_output);
+  if (header->version != kBinaryTrainDataVersion ||
+      length < sizeof(BinaryTrainDataHeader) + num_values * sizeof(fann_type)) {
+    return FannTrainData();
+  }
+  
+  const fann_type *input = reinterpret_cast<const fann_type*>(
+      static_cast<const char*>(address) + sizeof(BinaryTrainDataHeader));
+  const fann_type *output = input +
+      static_cast<std::size_t>(header->num_data) * header->num_input;
+  auto data = FannTrainData(fann_create_train_view(header->num_data,
+                                                   header->num_input,
+                                                   header->num_output),
+                            TrainDataDeleter{true, mapping});
+  
+  // Note: FANN's rows are not const, but nothing writes to loaded samples
+  for (unsigned sample = 0; sample < header->num_data; ++sample) {
+    fann_set_train_view(
+        data.get(), sample,
+        const_cast<fann_type*>(input + sample * header->num_input),
+        const_cast<fann_type*>(output + sample * header->num_output));
+  }
+  
+  return data;
+}
+
+/** Location and dimensions of a data set file within the combined data. */
+struct TrainDataFile {
+  bool binary;
+  std::size_t bytes;
+  unsigned num_data;
+  unsigned num_input;
+  unsigned num_output;
+  unsigned first_sample;
+};
+
+/** Reads the dimensions of a data set file in either supported format. */
+static bool ReadTrainDataHeader(const std::string &path, TrainDataFile &file) {
+  file.binary = IsBinaryTrainData(path);
+  
+  std::ifstream stream(path, std::ifstream::binary);
+  if (file.binary) {
+    BinaryTrainDataHeader header;
+    stream.read(reinterpret_cast<char*>(&header), sizeof(header));
+    file.num_data = header.num_data;
+    file.num_input = header.num_input;
+    file.num_output = header.num_output;
+  } else {
+    stream >> file.num_data >> file.num_input >> file.num_output;
+  }
+  stream.seekg(0, std::ifstream::end);
+  file.bytes = static_cast<std::size_t>(stream.tellg());
+  
+  return static_cast<bool>(stream);
+}
+
+/**
+  Parses the samples of a FANN formatted file into the combined data. Values
+  are parsed from the whole file in memory rather than with fscanf.
+*/
+static bool ParseTrainDataFile(const std::string &path,
+                               const TrainDataFile &file,
+                               fann_train_data *data) {
+  std::ifstream stream(path, std::ifstream::binary|std::ifstream::ate);
+  std::string text(static_cast<std::size_t>(stream.tellg()), '\0');
+  stream.seekg(0);
+  if (!stream.read(&text[0], static_cast<std::streamsize>(text.size()))) {
+    return false;
+  }
   
-  if (!files.empty()) {
-    data = FannTrainData(fann_read_train_from_file(files.front().c_str()));
+  const char *position = text.c_str();
+  char *end;
+  for (int value = 0; value < 3; ++value) {  // Skip the header
+    std::strtoul(position, &end, 10);
+    position = end;
+  }
+  
+  auto parse_values = [&](fann_type *values, unsigned count) {
+    for (unsigned value = 0; value < count; ++value) {
+      values[value] = std::strtof(position, &end);
+      if (end == position) {
+        return false;
+      }
+      position = end;
+    }
+    return true;
+  };
+  for (unsigned sample = 0; sample < file.num_data; ++sample) {
+    unsigned index = file.first_sample + sample;
+    if (!parse_values(data->input[index], file.num_input) ||
+        !parse_values(data->output[index], file.num_output)) {
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+/** Copies the samples of a binary file into the combined data. */
+static bool CopyBinaryTrainDataFile(const std::string &path,
+                                    const TrainDataFile &file,
+                                    fann_train_data *data) {
+  FannTrainData file_data = MapBinaryTrainData(path);
+  if (!file_data) {
+    return false;
+  }
+  
+  for (unsigned sample = 0; sample < file.num_data; ++sample) {
+    unsigned index = file.first_sample + sample;
+    std::copy_n(file_data->input[sample], file.num_input, data->input[index]);
+    std::copy_n(file_data->output[sample], file.num_output,
+                data->output[index]);
+  }
     
-    for (unsigned file_index = 1; file_index < files.size(); ++file_index) {
-      auto data_to_merge = FannTrainData(fann_read_train_from_file(
-          files[file_index].c_str()));
-      data = FannTrainData(fann_merge_train_data(data.get(),
-                                                 data_to_merge.get()));
+  return true;
+}
+      
+FannTrainData LoadTrainData(std::vector<std::string> files,
+                            std::vector<TrainDataFileStats> *file_stats) {
+  if (files.empty()) {
+    return FannTrainData();
+  }
+  
+  // A single binary file is used in place
+  if (files.size() == 1 && IsBinaryTrainData(files.front())) {
+    FannTrainData data = MapBinaryTrainData(files.front());
+    if (data && file_stats) {
+      file_stats->assign(1, {files.front(), data->num_data, 0, 0.0});
     }
+    return data;
+  }
+  
+  // Read every header first so the combined data is allocated once
+  std::vector<TrainDataFile> file_layouts(files.size());
+  unsigned num_data = 0;
+  for (unsigned file = 0; file < files.size(); ++file) {
+    TrainDataFile &layout = file_layouts[file];
+    if (!ReadTrainDataHeader(files[file], layout) ||
+        layout.num_input != file_layouts.front().num_input ||
+        layout.num_output != file_layouts.front().num_output) {
+      return FannTrainData();
+    }
+    layout.first_sample = num_data;
+    num_data += layout.num_data;
+  }
+  FannTrainData data(fann_create_train(num_data,
+                                       file_layouts.front().num_input,
+                                       file_layouts.front().num_output));
+  
+  // Each file is loaded directly into its final position
+  std::vector<TrainDataFileStats> stats(files.size());
+  std::vector<char> loaded(files.size(), false);
+  auto load_file = [&](unsigned file) {
+    auto start = std::chrono::steady_clock::now();
+    const TrainDataFile &layout = file_layouts[file];
+    loaded[file] = layout.binary
+        ? CopyBinaryTrainDataFile(files[file], layout, data.get())
+        : ParseTrainDataFile(files[file], layout, data.get());
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    stats[file] = {files[file], layout.num_data, layout.bytes,
+                   elapsed.count()};
+  };
+#ifdef MULTITHREAD
+  TaskGroup loads;
+  for (unsigned file = 0; file < files.size(); ++file) {
+    loads.Run([&, file]() { load_file(file); });
+  }
+  loads.Wait();
+#else
+  for (unsigned file = 0; file < files.size(); ++file) {
+    load_file(file);
+  }
+#endif
+
+  if (std::find(loaded.begin(), loaded.end(), false) != loaded.end()) {
+    return FannTrainData();
+  }
+  if (file_stats) {
+    *file_stats = std::move(stats);
   }
   
   return data;
 }
 
+bool WriteBinaryTrainData(std::string path, const FannTrainData &data) {
+  BinaryTrainDataHeader header = {};
+  std::memcpy(header.magic, kBinaryTrainDataMagic, sizeof(header.magic));
+  header.version = kBinaryTrainDataVersion;
+  header.num_data = fann_length_train_data(data.get());
+  header.num_input = fann_num_input_train_data(data.get());
+  header.num_output = fann_num_output_train_data(data.get());
+  
+  std::ofstream file(path, std::ofstream::binary|std::ofstream::trunc);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (unsigned sample = 0; sample < header.num_data; ++sample) {
+    file.write(reinterpret_cast<const char*>(data->input[sample]),
+               header.num_input * sizeof(fann_type));
+  }
+  for (unsigned sample = 0; sample < header.num_data; ++sample) {
+    file.write(reinterpret_cast<const char*>(data->output[sample]),
+               header.num_output * sizeof(fann_type));
+  }
+  
+  return static_cast<bool>(file.flush());
+}
+
 std::vector<FannTrainData> StratifyTrainData(
     FannTrainData &data,
     unsigned groups,
@@ -84,6 +347,8 @@ std::vector<FannTrainData> StratifyTrainData(
 void WriteCsv(std::string path,
               std::vector<std::vector<float>> data,
               std::vector<std::string> header) {
+  PROFILE_SCOPE(ProfilePhase::kWriteCsv);
+  PROFILE_COUNT(ProfileCounter::kCsvRows, data.size());
 
   std::ofstream csv_ostream(path, std::ofstream::out|std::ofstream::trunc);
   
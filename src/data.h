@@ -21,23 +21,76 @@
 #ifndef DATA_H_
 #define DATA_H_
 
+#include <cstddef>
 #include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "fann_types.h"
 
+/** Time taken to load a single data set file. */
+struct TrainDataFileStats {
+  std::string path;
+  unsigned num_samples;
+  std::size_t bytes;  // Zero for files used in place
+  double seconds;
+};
+
 /**
   \rst
   Loads a list of files that contain FANN formatted training data and returns a
-  ``FannTrainData`` object.
+  ``FannTrainData`` object. Files written by ``WriteBinaryTrainData`` are
+  detected and memory mapped rather than parsed; a single binary file is used
+  in place without copying its samples. Its mapping is read-only and shared
+  with other processes mapping the file, so the samples must not be written
+  (a write faults rather than silently copying the page).
+
+  The headers of every file are read first so the combined data is allocated
+  once, then files are loaded (in parallel for ``MULTITHREAD`` builds) straight
+  into their position in the combined data. The time taken for each file is
+  returned through ``file_stats`` when supplied. An empty object is returned if
+  any file cannot be loaded or the files have different numbers of inputs or
+  outputs.
 
   ***Example**::
 
     LoadTrainData({"file1.dat", "file2.dat"});
   \endrst
 */
-FannTrainData LoadTrainData(std::vector<std::string> files);
+FannTrainData LoadTrainData(
+    std::vector<std::string> files,
+    std::vector<TrainDataFileStats> *file_stats = nullptr);
+
+/**
+  \rst
+  Writes a ``FannTrainData`` object to a binary file that ``LoadTrainData`` can
+  memory map. The file holds a 32 byte header (magic ``GBMD``, format version,
+  number of samples, inputs and outputs) followed by the inputs of every sample
+  and then the outputs of every sample as contiguous host order floats.
+  Returns false if the file could not be written.
+  
+  ***Example**::
+  
+    WriteBinaryTrainData("data.bin", LoadTrainData({"data.dat"}));
+  \endrst
+*/
+bool WriteBinaryTrainData(std::string path, const FannTrainData &data);
+
+/**
+  \rst
+  Maps a whole file into memory, returning an owner that unmaps it when the
+  last reference is released (or null on failure) and setting ``length`` to
+  the size of the file. The mapping is read-only and shared with other
+  processes mapping the same file.
+  
+  ***Example**::
+  
+    std::size_t length;
+    std::shared_ptr<void> mapping = MapFile("model.bin", length);
+  \endrst
+*/
+std::shared_ptr<void> MapFile(const std::string &path, std::size_t &length);
 
 /**
   \rst
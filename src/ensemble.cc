@@ -20,48 +20,554 @@
 
 #include "ensemble.h"
 
-#include <fann.h>
-
 #include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <functional>
+#include <limits>
+#include <numeric>
 
-Ensemble::Ensemble() {}
-  
-void Ensemble::Add(FannNetwork network) {
-  networks_.push_back(std::move(network));
+#include "data.h"
+
+// Samples evaluated by every member before moving to the next block
+static const unsigned kPredictBlockSize = 256;
+
+// Layout of ensemble files: header, a record for each layer, then the weights
+// of every network in the packed layout starting at a 32 byte boundary
+struct EnsembleFileHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t num_layers;
+  std::uint32_t num_networks;
+  std::uint32_t num_weights;  // Per network
+  std::uint32_t reserved[3];
+};
+
+struct EnsembleFileLayer {
+  std::uint32_t num_input;
+  std::uint32_t num_output;
+  std::uint32_t activation_function;
+  float activation_steepness;
+};
+
+static const char kEnsembleFileMagic[4] = {'G', 'B', 'M', 'E'};
+static const std::uint32_t kEnsembleFileVersion = 1;
+static const std::size_t kEnsembleFileAlignment = 32;
+
+/** Offset of the weights in an ensemble file. */
+static std::size_t EnsembleFileWeightsOffset(std::uint32_t num_layers) {
+  std::size_t offset = sizeof(EnsembleFileHeader) +
+      num_layers * sizeof(EnsembleFileLayer);
+  return (offset + kEnsembleFileAlignment - 1) / kEnsembleFileAlignment *
+      kEnsembleFileAlignment;
 }
 
-std::vector<float> Ensemble::Run(float *input) {
-  std::vector<float> ensemble_output(fann_get_num_output(networks_[0].get()),
-                                     0.0f);
+Ensemble::Ensemble(EnsembleStorage storage)
+    : storage_(storage),
+      packed_weights_(nullptr),
+      packed_num_weights_(0),
+      packed_size_(0),
+      packed_capacity_(0),
+      packed_max_layer_size_(0) {}
   
-  for (unsigned network = 0; network < networks_.size(); ++network) {
-    float *network_output = fann_run(networks_[network].get(), input);
-    for (unsigned output = 0; output < ensemble_output.size(); ++output) {
-      ensemble_output[output] += network_output[output];
-    }
+bool Ensemble::Add(FannNetwork network) {
+  if (storage_ == EnsembleStorage::kPacked) {
+    return AddPacked(network);
   }
   
-  // Calculate the mean output from the networks in the ensemble
-  std::transform(ensemble_output.begin(), ensemble_output.end(),
-                 ensemble_output.begin(),
-                 std::bind(std::divides<float>(), std::placeholders::_1,
-                           static_cast<float>(networks_.size())));
+  compiled_networks_.emplace_back(network);
+  networks_.push_back(std::move(network));
+  return true;
+}
+
+std::vector<float> Ensemble::Run(float *input) {
+  std::vector<float> ensemble_output(NumOutput());
+  Predict(&input, 1, ensemble_output.data());
   
   return ensemble_output;
 }
 
 std::vector<std::vector<float>> Ensemble::Predict(FannTrainData &data) {
-  std::vector<std::vector<float>> ensemble_predictions;
-  
   unsigned num_samples = fann_length_train_data(data.get());
+  unsigned num_output = NumOutput();
+  std::vector<float> outputs(num_samples * num_output);
+  Predict(data->input, num_samples, outputs.data());
+  
+  std::vector<std::vector<float>> ensemble_predictions;
   for (unsigned sample = 0; sample < num_samples; ++sample) {
-    ensemble_predictions.push_back(Run(data->input[sample]));
+    ensemble_predictions.emplace_back(outputs.begin() + sample * num_output,
+                                      outputs.begin() +
+                                      (sample + 1) * num_output);
   }
   
   return ensemble_predictions;
 }
 
+void Ensemble::Predict(float **input,
+                       unsigned num_samples,
+                       float *output) const {
+  const unsigned num_output = NumOutput();
+  
+  if (storage_ == EnsembleStorage::kPacked) {
+    PredictPacked(input, num_samples, output);
+    return;
+  }
+  
+  std::vector<float> network_outputs(kPredictBlockSize * num_output);
+  for (unsigned sample = 0; sample < num_samples;
+       sample += kPredictBlockSize) {
+    unsigned block_samples = std::min(kPredictBlockSize,
+                                      num_samples - sample);
+    float *block_output = output + sample * num_output;
+    std::fill_n(block_output, block_samples * num_output, 0.0f);
+    
+    for (const CompiledNetwork &network : compiled_networks_) {
+      network.Run(input + sample, block_samples, network_outputs.data());
+      for (unsigned value = 0; value < block_samples * num_output; ++value) {
+        block_output[value] += network_outputs[value];
+      }
+    }
+    
+    // Calculate the mean output from the networks in the ensemble
+    std::transform(block_output, block_output + block_samples * num_output,
+                   block_output,
+                   std::bind(std::divides<float>(), std::placeholders::_1,
+                             static_cast<float>(Size())));
+  }
+}
+
+unsigned Ensemble::Size() const {
+  return storage_ == EnsembleStorage::kPacked
+      ? packed_size_
+      : static_cast<unsigned>(networks_.size());
+}
+
+unsigned Ensemble::NumInput() const {
+  if (Size() == 0) {
+    return 0;
+  }
+  return storage_ == EnsembleStorage::kPacked
+      ? packed_layers_.front().num_input
+      : compiled_networks_.front().NumInput();
+}
+
+unsigned Ensemble::NumOutput() const {
+  if (Size() == 0) {
+    return 0;
+  }
+  return storage_ == EnsembleStorage::kPacked
+      ? packed_layers_.back().num_output
+      : compiled_networks_.front().NumOutput();
+}
+
 void Ensemble::Reset() {
   networks_.clear();
+  compiled_networks_.clear();
+  packed_layers_.clear();
+  packed_arena_.clear();
+  packed_mapping_.reset();
+  packed_weights_ = nullptr;
+  packed_num_weights_ = 0;
+  packed_size_ = 0;
+  packed_capacity_ = 0;
+  packed_max_layer_size_ = 0;
+}
+
+Ensemble Ensemble::Select(const std::vector<unsigned> &members) const {
+  Ensemble selected(storage_);
+  if (storage_ != EnsembleStorage::kPacked) {
+    for (unsigned member : members) {
+      selected.Add(FannNetwork(fann_copy(networks_[member].get())));
+    }
+    return selected;
+  }
+  
+  const unsigned capacity = static_cast<unsigned>(members.size());
+  selected.packed_layers_ = packed_layers_;
+  selected.packed_arena_.resize(static_cast<std::size_t>(packed_num_weights_) *
+                                capacity);
+  for (unsigned weight = 0; weight < packed_num_weights_; ++weight) {
+    for (unsigned member = 0; member < capacity; ++member) {
+      selected.packed_arena_[weight * capacity + member] =
+          packed_weights_[weight * packed_capacity_ + members[member]];
+    }
+  }
+  selected.packed_weights_ = selected.packed_arena_.data();
+  selected.packed_num_weights_ = packed_num_weights_;
+  selected.packed_size_ = capacity;
+  selected.packed_capacity_ = capacity;
+  selected.packed_max_layer_size_ = packed_max_layer_size_;
+  
+  return selected;
+}
+
+bool Ensemble::Save(const std::string &path) const {
+  if (storage_ != EnsembleStorage::kPacked) {
+    Ensemble packed_ensemble(EnsembleStorage::kPacked);
+    for (const FannNetwork &network : networks_) {
+      if (!packed_ensemble.AddPacked(network)) {
+        return false;
+      }
+    }
+    return packed_ensemble.Save(path);
+  }
+  
+  EnsembleFileHeader header = {};
+  std::memcpy(header.magic, kEnsembleFileMagic, sizeof(header.magic));
+  header.version = kEnsembleFileVersion;
+  header.num_layers = static_cast<std::uint32_t>(packed_layers_.size());
+  header.num_networks = packed_size_;
+  header.num_weights = packed_num_weights_;
+  
+  std::ofstream file(path, std::ofstream::binary|std::ofstream::trunc);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (const PackedLayer &layer : packed_layers_) {
+    EnsembleFileLayer file_layer = {
+      layer.num_input,
+      layer.num_output,
+      static_cast<std::uint32_t>(layer.activation_function),
+      layer.activation_steepness,
+    };
+    file.write(reinterpret_cast<const char*>(&file_layer),
+               sizeof(file_layer));
+  }
+  std::size_t padding = EnsembleFileWeightsOffset(header.num_layers) -
+      sizeof(header) - packed_layers_.size() * sizeof(EnsembleFileLayer);
+  file.write(std::string(padding, '\0').data(), padding);
+  
+  // The arena's spare capacity is not saved
+  for (unsigned weight = 0; weight < packed_num_weights_; ++weight) {
+    file.write(reinterpret_cast<const char*>(
+                   packed_weights_ + weight * packed_capacity_),
+               packed_size_ * sizeof(fann_type));
+  }
+  
+  return static_cast<bool>(file.flush());
+}
+
+bool Ensemble::Load(const std::string &path) {
+  std::size_t length = 0;
+  std::shared_ptr<void> mapping = MapFile(path, length);
+  if (!mapping || length < sizeof(EnsembleFileHeader)) {
+    return false;
+  }
+  
+  auto address = static_cast<const char*>(mapping.get());
+  auto header = reinterpret_cast<const EnsembleFileHeader*>(address);
+  if (std::memcmp(header->magic, kEnsembleFileMagic,
+                  sizeof(header->magic)) != 0 ||
+      header->version != kEnsembleFileVersion ||
+      header->num_layers == 0 ||
+      header->num_networks == 0 ||
+      length < EnsembleFileWeightsOffset(header->num_layers) +
+          static_cast<std::size_t>(header->num_weights) *
+          header->num_networks * sizeof(fann_type)) {
+    return false;
+  }
+  
+  // Rebuild the topology, checking it accounts for every weight
+  // Note: Sizes are accumulated in 64 bits and bounded by the weights of a
+  // network, so a crafted file cannot wrap them around to match the header
+  std::vector<PackedLayer> layers;
+  std::uint64_t first_weight = 0;
+  unsigned max_layer_size = 0;
+  auto file_layers = reinterpret_cast<const EnsembleFileLayer*>(
+      address + sizeof(EnsembleFileHeader));
+  for (std::uint32_t layer = 0; layer < header->num_layers; ++layer) {
+    const EnsembleFileLayer &file_layer = file_layers[layer];
+    std::uint64_t layer_weights = static_cast<std::uint64_t>(
+        file_layer.num_output) * (std::uint64_t(file_layer.num_input) + 1);
+    if ((layer > 0 && file_layer.num_input != layers.back().num_output) ||
+        file_layer.num_input == 0 ||
+        file_layer.num_output == 0 ||
+        file_layer.activation_function > FANN_COS ||
+        layer_weights > header->num_weights ||
+        first_weight + layer_weights > header->num_weights) {
+      return false;
+    }
+    PackedLayer packed;
+    packed.num_input = file_layer.num_input;
+    packed.num_output = file_layer.num_output;
+    packed.activation_function = static_cast<fann_activationfunc_enum>(
+        file_layer.activation_function);
+    packed.activation_steepness = file_layer.activation_steepness;
+    packed.first_weight = static_cast<unsigned>(first_weight);
+    first_weight += layer_weights;
+    max_layer_size = std::max({max_layer_size, packed.num_input + 1,
+                               packed.num_output});
+    layers.push_back(packed);
+  }
+  if (first_weight != header->num_weights) {
+    return false;
+  }
+  
+  Reset();
+  storage_ = EnsembleStorage::kPacked;
+  packed_layers_ = std::move(layers);
+  packed_weights_ = reinterpret_cast<const fann_type*>(
+      address + EnsembleFileWeightsOffset(header->num_layers));
+  packed_num_weights_ = header->num_weights;
+  packed_size_ = header->num_networks;
+  packed_capacity_ = header->num_networks;
+  packed_max_layer_size_ = max_layer_size;
+  packed_mapping_ = std::move(mapping);
+  
+  return true;
+}
+
+bool Ensemble::AddPacked(const FannNetwork &network) {
+  const fann *ann = network.get();
+  const unsigned num_weights = static_cast<unsigned>(
+      ann->total_connections);
+  
+  std::vector<PackedLayer> layers;
+  unsigned first_weight = 0;
+  for (fann_layer *layer = ann->first_layer + 1; layer != ann->last_layer;
+       ++layer) {
+    fann_layer *previous_layer = layer - 1;
+    PackedLayer packed;
+    packed.num_input = static_cast<unsigned>(
+        previous_layer->last_neuron - previous_layer->first_neuron) - 1;
+    packed.num_output = static_cast<unsigned>(
+        layer->last_neuron - layer->first_neuron) - 1;  // Bias neuron
+    packed.activation_function = layer->first_neuron->activation_function;
+    packed.activation_steepness = layer->first_neuron->activation_steepness;
+    packed.first_weight = first_weight;
+    first_weight += packed.num_output * (packed.num_input + 1);
+    layers.push_back(packed);
+  }
+  
+  // The first network defines the topology shared by the ensemble and later
+  // networks must match it exactly
+  if (packed_layers_.empty()) {
+    for (const PackedLayer &packed : layers) {
+      packed_max_layer_size_ = std::max({packed_max_layer_size_,
+                                         packed.num_input + 1,
+                                         packed.num_output});
+    }
+    packed_layers_ = layers;
+    packed_num_weights_ = num_weights;
+  } else if (num_weights != packed_num_weights_ ||
+             layers.size() != packed_layers_.size() ||
+             !std::equal(layers.begin(), layers.end(), packed_layers_.begin(),
+                         [](const PackedLayer &left,
+                            const PackedLayer &right) {
+    return left.num_input == right.num_input &&
+        left.num_output == right.num_output &&
+        left.activation_function == right.activation_function &&
+        left.activation_steepness == right.activation_steepness;
+  })) {
+    return false;
+  }
+  
+  // Grow the arena geometrically, moving existing weights to the new stride
+  // (weights of a loaded file are moved into an arena the first time)
+  if (packed_size_ == packed_capacity_ || packed_mapping_) {
+    unsigned capacity = std::max({2 * packed_capacity_, packed_size_ + 1, 8u});
+    std::vector<fann_type> arena(static_cast<std::size_t>(num_weights) *
+                                 capacity);
+    for (unsigned weight = 0; weight < num_weights; ++weight) {
+      std::copy_n(packed_weights_ + weight * packed_capacity_,
+                  packed_size_,
+                  arena.begin() + weight * capacity);
+    }
+    packed_arena_.swap(arena);
+    packed_mapping_.reset();
+    packed_weights_ = packed_arena_.data();
+    packed_capacity_ = capacity;
+  }
+  
+  // Connections of a fully connected network are stored layer by layer in
+  // the same order as the arena
+  for (unsigned weight = 0; weight < num_weights; ++weight) {
+    packed_arena_[weight * packed_capacity_ + packed_size_] =
+        ann->weights[weight];
+  }
+  ++packed_size_;
+  return true;
+}
+
+void Ensemble::PredictPacked(float **input,
+                             unsigned num_samples,
+                             float *output) const {
+  const unsigned block = CompiledNetwork::kBlockSize;
+  const unsigned stride = packed_capacity_;
+  const unsigned size = packed_size_;
+  
+  // Neuron values of every sample in the block and every network, network
+  // minor, so each weight is loaded once per block of samples
+  thread_local static std::vector<fann_type> scratch;
+  const std::size_t layer_values = static_cast<std::size_t>(
+      packed_max_layer_size_) * block * stride;
+  scratch.resize(std::max<std::size_t>(scratch.size(),
+                                       2 * layer_values + block * stride));
+  fann_type *values = scratch.data();
+  fann_type *next_values = values + layer_values;
+  fann_type *sums = next_values + layer_values;
+  
+  const unsigned num_input = packed_layers_.front().num_input;
+  const unsigned num_output = packed_layers_.back().num_output;
+  for (unsigned first = 0; first < num_samples; first += block) {
+    const unsigned samples = std::min(block, num_samples - first);
+    for (unsigned neuron = 0; neuron < num_input; ++neuron) {
+      for (unsigned s = 0; s < samples; ++s) {
+        std::fill_n(values + (neuron * block + s) * stride, size,
+                    input[first + s][neuron]);
+      }
+    }
+    
+    for (const PackedLayer &layer : packed_layers_) {
+      
+      // Bias neuron
+      for (unsigned s = 0; s < samples; ++s) {
+        std::fill_n(values + (layer.num_input * block + s) * stride, size,
+                    1.0f);
+      }
+      
+      const unsigned num_connections = layer.num_input + 1;
+      const fann_type steepness = layer.activation_steepness;
+      const fann_type max_sum = 150 / steepness;
+      for (unsigned neuron = 0; neuron < layer.num_output; ++neuron) {
+        const fann_type *weights = packed_weights_ +
+            (layer.first_weight + neuron * num_connections) * stride;
+        
+        // Accumulate in the same order as fann_run
+        for (unsigned s = 0; s < samples; ++s) {
+          std::fill_n(sums + s * stride, size, 0.0f);
+        }
+        unsigned i = num_connections & 3;
+        for (unsigned c = i; c-- > 0;) {
+          const fann_type *w = weights + c * stride;
+          for (unsigned s = 0; s < samples; ++s) {
+            const fann_type *v = values + (c * block + s) * stride;
+            fann_type *sample_sums = sums + s * stride;
+            for (unsigned n = 0; n < size; ++n) {
+              sample_sums[n] += w[n] * v[n];
+            }
+          }
+        }
+        for (; i != num_connections; i += 4) {
+          const fann_type *w = weights + i * stride;
+          for (unsigned s = 0; s < samples; ++s) {
+            const fann_type *v = values + (i * block + s) * stride;
+            const unsigned v_stride = block * stride;
+            fann_type *sample_sums = sums + s * stride;
+            for (unsigned n = 0; n < size; ++n) {
+              sample_sums[n] += w[n] * v[n] +
+                  w[stride + n] * v[v_stride + n] +
+                  w[2 * stride + n] * v[2 * v_stride + n] +
+                  w[3 * stride + n] * v[3 * v_stride + n];
+            }
+          }
+        }
+        
+        for (unsigned s = 0; s < samples; ++s) {
+          fann_type *sample_sums = sums + s * stride;
+          for (unsigned n = 0; n < size; ++n) {
+            fann_type sum = steepness * sample_sums[n];
+            sample_sums[n] = sum > max_sum
+                ? max_sum : (sum < -max_sum ? -max_sum : sum);
+          }
+          ActivateNeurons(layer.activation_function, sample_sums,
+                          next_values + (neuron * block + s) * stride, size);
+        }
+      }
+      
+      std::swap(values, next_values);
+    }
+    
+    // Calculate the mean output from the networks in the ensemble
+    for (unsigned s = 0; s < samples; ++s) {
+      for (unsigned neuron = 0; neuron < num_output; ++neuron) {
+        const fann_type *neuron_values = values +
+            (neuron * block + s) * stride;
+        float total = 0.0f;
+        for (unsigned n = 0; n < size; ++n) {
+          total += neuron_values[n];
+        }
+        output[(first + s) * num_output + neuron] =
+            total / static_cast<float>(size);
+      }
+    }
+  }
+}
+
+std::vector<unsigned> SelectEnsembleMembers(
+    const std::vector<std::vector<float>> &candidate_predictions,
+    const std::vector<float> &targets,
+    unsigned max_members,
+    float tolerance) {
+  
+  const unsigned num_candidates = static_cast<unsigned>(
+      candidate_predictions.size());
+  std::vector<unsigned> all_candidates(num_candidates);
+  std::iota(all_candidates.begin(), all_candidates.end(), 0u);
+  double target_error = EnsembleMeanSquaredError(
+      candidate_predictions, all_candidates, targets) *
+      (1.0 + static_cast<double>(tolerance));
+  
+  // Predictions of the selected candidates are summed so each trial addition
+  // costs a single pass over the targets
+  std::vector<double> selected_sum(targets.size(), 0.0);
+  std::vector<bool> used(num_candidates, false);
+  std::vector<unsigned> selected;
+  while (selected.size() < std::min(max_members, num_candidates)) {
+    double scale = 1.0 / static_cast<double>(selected.size() + 1);
+    unsigned best_candidate = num_candidates;
+    double best_error = std::numeric_limits<double>::max();
+    for (unsigned candidate = 0; candidate < num_candidates; ++candidate) {
+      if (used[candidate]) {
+        continue;
+      }
+      const std::vector<float> &predictions =
+          candidate_predictions[candidate];
+      double error = 0.0;
+      for (unsigned element = 0; element < targets.size(); ++element) {
+        double difference = (selected_sum[element] + predictions[element]) *
+            scale - targets[element];
+        error += difference * difference;
+      }
+      if (error < best_error) {
+        best_error = error;
+        best_candidate = candidate;
+      }
+    }
+    
+    used[best_candidate] = true;
+    selected.push_back(best_candidate);
+    const std::vector<float> &predictions =
+        candidate_predictions[best_candidate];
+    for (unsigned element = 0; element < targets.size(); ++element) {
+      selected_sum[element] += predictions[element];
+    }
+    if (best_error / std::max<std::size_t>(targets.size(), 1) <=
+        target_error) {
+      break;
+    }
+  }
+  
+  return selected;
+}
+
+double EnsembleMeanSquaredError(
+    const std::vector<std::vector<float>> &candidate_predictions,
+    const std::vector<unsigned> &selected,
+    const std::vector<float> &targets) {
+  
+  if (selected.empty() || targets.empty()) {
+    return 0.0;
+  }
+  double error = 0.0;
+  for (unsigned element = 0; element < targets.size(); ++element) {
+    double prediction = 0.0;
+    for (unsigned candidate : selected) {
+      prediction += candidate_predictions[candidate][element];
+    }
+    double difference = prediction / selected.size() - targets[element];
+    error += difference * difference;
+  }
+  
+  return error / targets.size();
 }
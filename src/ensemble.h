@@ -17,21 +17,44 @@
   You should have received a copy of the GNU General Public License
   along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
+
 #ifndef ENSEMBLE_H_
 #define ENSEMBLE_H_
 
+#include <fann.h>
+
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "fann_types.h"
+#include "inference.h"
+
+/** How an ``Ensemble`` stores its networks. */
+enum class EnsembleStorage {
+  /** Keep every network (any topology). */
+  kSeparate,
+  
+  /**
+    Keep a single topology with the weights of every network in one arena,
+    corresponding weights of all networks adjacent, and evaluate all networks
+    together. Networks must share layer sizes, activation functions and
+    steepnesses, as networks created from one ``FannNetworkDescriptor`` do.
+  */
+  kPacked
+};
 
 /** An ensemble of ``FannNetwork`` objects. */
 class Ensemble {
  public:
   /** Create an empty ensemble. */
-  Ensemble();
+  explicit Ensemble(EnsembleStorage storage = EnsembleStorage::kSeparate);
   
-  /** Add a network to the ensemble. */
-  void Add(FannNetwork network);
+  /**
+    Add a network to the ensemble. Returns false if the ensemble uses packed
+    storage and the network does not share the topology of its first network.
+  */
+  bool Add(FannNetwork network);
   
   /** Make a single predict using the ensemble. */
   std::vector<float> Run(float *input);
@@ -39,11 +62,133 @@ class Ensemble {
   /** Make predictions for an entire data set. */
   std::vector<std::vector<float>> Predict(FannTrainData &data);
   
+  /**
+    \rst
+    Make predictions for a batch of samples, writing ``num_samples`` rows of
+    outputs to ``output``. Members are evaluated over blocks of samples so the
+    weights of each member are reused across the block.
+    
+    ***Example**::
+    
+      std::vector<float> predictions(num_samples * ensemble.NumOutput());
+      ensemble.Predict(data->input, num_samples, predictions.data());
+    \endrst
+  */
+  void Predict(float **input, unsigned num_samples, float *output) const;
+  
+  /** Number of networks in the ensemble. */
+  unsigned Size() const;
+  
+  /** Number of inputs of the networks in the ensemble (0 when empty). */
+  unsigned NumInput() const;
+  
+  /** Number of outputs of the networks in the ensemble (0 when empty). */
+  unsigned NumOutput() const;
+  
   /** Remove all networks from the ensemble. */
   void Reset();
   
+  /**
+    \rst
+    Create an ensemble with the same storage from a subset of the networks,
+    given by their indices in order of addition. Packed weights are copied, so
+    the new ensemble does not depend on this one.
+    
+    ***Example**::
+    
+      Ensemble pruned = ensemble.Select({0, 1, 4});
+    \endrst
+  */
+  Ensemble Select(const std::vector<unsigned> &members) const;
+  
+  /**
+    \rst
+    Save the ensemble to a single binary file holding the shared topology,
+    activation functions, steepnesses and the weights of every network in the
+    packed layout. All networks must share a topology. Returns false if they
+    do not or the file could not be written.
+    \endrst
+  */
+  bool Save(const std::string &path) const;
+  
+  /**
+    \rst
+    Replace the ensemble with one saved by ``Save``. The file is memory mapped
+    read-only and its weights are used in place with packed storage, so the
+    ensemble is ready for predictions without parsing or copying. Returns false
+    if the file is missing or invalid.
+    
+    ***Example**::
+    
+      Ensemble ensemble;
+      ensemble.Load("models/ensemble-0.bin");
+      ensemble.Predict(data->input, num_samples, predictions.data());
+    \endrst
+  */
+  bool Load(const std::string &path);
+  
  private:
+  struct PackedLayer {
+    unsigned num_input;  // Excluding the bias
+    unsigned num_output;
+    fann_activationfunc_enum activation_function;
+    fann_type activation_steepness;
+    unsigned first_weight;  // Index of the first connection in the arena
+  };
+  
+  bool AddPacked(const FannNetwork &network);
+  void PredictPacked(float **input, unsigned num_samples,
+                     float *output) const;
+  
+  EnsembleStorage storage_;
+  
+  // Separate storage
   std::vector<FannNetwork> networks_;
+  std::vector<CompiledNetwork> compiled_networks_;
+  
+  // Packed storage with the weight of connection c for network n at
+  // packed_weights_[c * packed_capacity_ + n], pointing either into
+  // packed_arena_ or into a memory mapped file owned by packed_mapping_
+  std::vector<PackedLayer> packed_layers_;
+  std::vector<fann_type> packed_arena_;
+  std::shared_ptr<void> packed_mapping_;
+  const fann_type *packed_weights_;
+  unsigned packed_num_weights_;
+  unsigned packed_size_;
+  unsigned packed_capacity_;
+  unsigned packed_max_layer_size_;
 };
 
+/**
+  \rst
+  Selects a subset of candidate ensemble members by greedy forward selection
+  on held-out predictions. Each candidate supplies a prediction for every
+  element of ``targets`` (e.g. the out-of-fold predictions of the networks
+  of one cross validation repeat). The candidate whose addition gives the
+  lowest mean squared error of the averaged predictions is added until the
+  error is within ``tolerance`` (relative) of the error of averaging every
+  candidate, or ``max_members`` are selected. Returns the indices of the
+  selected candidates in the order they were added.
+  
+  ***Example**::
+  
+    std::vector<unsigned> selected = SelectEnsembleMembers(
+        repeat_predictions, targets, 10, 0.01f);
+  \endrst
+*/
+std::vector<unsigned> SelectEnsembleMembers(
+    const std::vector<std::vector<float>> &candidate_predictions,
+    const std::vector<float> &targets,
+    unsigned max_members,
+    float tolerance);
+
+/**
+  Mean squared error of the average of the selected candidates' predictions,
+  as minimised by ``SelectEnsembleMembers``.
+*/
+double EnsembleMeanSquaredError(
+    const std::vector<std::vector<float>> &candidate_predictions,
+    const std::vector<unsigned> &selected,
+    const std::vector<float> &targets);
+
 #endif // ENSEMBLE_H_
@@ -25,21 +25,78 @@
 #include <algorithm>
 #include <cmath>
 #include <functional>
-#include <future>
 #include <iostream>
 #include <limits>
 #include <memory>
-#include <mutex>
+#include <numeric>
 #include <random>
-#include <thread>
+#include <sstream>
+#include <string>
+#include <unordered_map>
 
 #include "config.h"
 #include "crossvalidate.h"
 #include "fann_extension.h"
+#include "profile.h"
+#include "threadpool.h"
 #include "train.h"
 
+thread_local static std::mt19937 rng{std::random_device{}()};
+
+// Result of training a descriptor's network on one fold of the run's plan
+// (i.e. the best epoch is zero for folds that were not trained)
+struct FoldResult {
+  std::vector<fann_type> weights;
+  float error = 0.0f;
+  int best_epoch = 0;
+  bool warm = false;
+};
+
+// Returns the error summed over the folds of each of a range of repeats of
+// the run's fold plan for a descriptor. Each fold's network is trained on its
+// own, so it returns to the pool before the next fold's network is created.
+// When ``fold_results`` is supplied (i.e. warm starting), each network starts
+// from the weights the descriptor inherited for the same fold of the plan when
+// possible, so it never starts from weights trained on its validation samples,
+// and the result of every fold is stored in the slot of its repeat and fold.
+static std::vector<double> EvaluateRepeats(
+    FannNetworkDescriptor &descriptor, FoldPlan &plan, int first_repeat,
+    int repeats, std::vector<FoldResult> *fold_results) {
+  std::vector<double> repeat_errors;
+  for (int repeat = first_repeat; repeat < first_repeat + repeats; ++repeat) {
+    std::vector<FannTrainData> &training_sets = plan.Training(repeat);
+    std::vector<FannTrainData> &validation_sets = plan.Validation(repeat);
+    double error = 0.0;
+    for (unsigned fold = 0; fold < training_sets.size(); ++fold) {
+      unsigned plan_fold = repeat * training_sets.size() + fold;
+      FannNetwork network = descriptor.CreateNetwork();
+      bool warm = fold_results &&
+          descriptor.WarmStartWeights(network, plan_fold);
+      if (!warm) {
+        descriptor.IntializeWeights(network, training_sets[fold]);
+      }
+      int best_epoch = 0;
+      float fold_error = TrainNetwork(network, training_sets[fold],
+                                      validation_sets[fold], &best_epoch);
+      error += static_cast<double>(fold_error);
+      if (fold_results) {
+        FoldResult &result = (*fold_results)[plan_fold];
+        result.weights.assign(network->weights,
+                              network->weights + network->total_connections);
+        result.error = fold_error;
+        result.best_epoch = best_epoch;
+        result.warm = warm;
+      }
+    }
+    repeat_errors.push_back(error);
+  }
+  return repeat_errors;
+}
+
 FannNetworkDescriptor EvolutionaryOptimize(
-    std::vector<FannTrainData> &stratified_data) {
+    std::vector<FannTrainData> &stratified_data,
+    const std::function<void(const EvolutionState&)> &checkpoint,
+    const EvolutionState *resume) {
   
   // Breeds new descriptors using crossover and random mutation
   auto generate_descriptors = [](
@@ -47,10 +104,10 @@ FannNetworkDescriptor EvolutionaryOptimize(
       float small_chance,
       float small_factor,
       float big_chance) -> std::vector<FannNetworkDescriptor> {
+    PROFILE_SCOPE(ProfilePhase::kBreeding);
     
     // Initialise random distribution to pick from population
-    thread_local static std::mt19937 rng{std::random_device{}()};
-    thread_local static std::uniform_int_distribution<> descriptor_dist(
+    std::uniform_int_distribution<> descriptor_dist(
         0, static_cast<int>(descriptors.size() - 1));
     
     std::vector<FannNetworkDescriptor> new_descriptors;
@@ -71,6 +128,13 @@ FannNetworkDescriptor EvolutionaryOptimize(
 
   double best_ever_score = std::numeric_limits<float>::max();
 
+  // Fitness of every descriptor evaluated during the optimization
+  std::unordered_map<FannNetworkDescriptor, double, FannNetworkDescriptorHash>
+      fitness_cache;
+  unsigned long cache_lookups = 0;
+  unsigned long cache_hits = 0;
+  unsigned long evaluated_repeats = 0;
+
   unsigned input_size = fann_num_input_train_data(stratified_data[0].get());
   unsigned output_size = fann_num_output_train_data(stratified_data[0].get());
 
@@ -80,7 +144,36 @@ FannNetworkDescriptor EvolutionaryOptimize(
       FannNetworkDescriptor(input_size, output_size), 
       std::numeric_limits<double>::max()));
 
-  for (int generation = 0; generation < kMaxGenerations; ++generation) {
+  // Every descriptor of the run is evaluated against the same folds so
+  // differences in error come from the descriptors rather than the partitions
+  // they drew (i.e. common random numbers), as the fitness cache assumes
+  unsigned plan_seed = std::uniform_int_distribution<unsigned>(
+      1, std::numeric_limits<unsigned>::max())(rng);
+  std::unique_ptr<FoldPlan> plan;
+  
+  // Continue from a checkpoint with the population, fold plan and random
+  // number generators as they were after its last generation
+  int first_generation = 0;
+  if (resume) {
+    first_generation = resume->generation;
+    best_ever_score = resume->best_ever_score;
+    plan_seed = resume->plan_seed;
+    scored_descriptors = resume->scored_descriptors;
+    for (unsigned descriptor = 0; descriptor < scored_descriptors.size();
+         ++descriptor) {
+      if (resume->complete_scores[descriptor]) {
+        fitness_cache.emplace(scored_descriptors[descriptor]);
+      }
+    }
+    std::istringstream rng_state(resume->rng_state);
+    std::string descriptor_rng_state;
+    rng_state >> rng;
+    std::getline(rng_state >> std::ws, descriptor_rng_state);
+    SetDescriptorRngState(descriptor_rng_state);
+  }
+  
+  for (int generation = first_generation; generation < kMaxGenerations;
+       ++generation) {
 
     // Breed new descriptors with exponential annealling of mutation rate
     float big_mutation_chance = kBigMutationStartChance - kBigMutationEndChance;
@@ -89,71 +182,189 @@ FannNetworkDescriptor EvolutionaryOptimize(
     std::vector<FannNetworkDescriptor> descriptors = generate_descriptors(
         scored_descriptors, 0.25f, 0.1f, big_mutation_chance);
 
-    // Evaluate fitness of each descriptor in the population
-    scored_descriptors.clear();
+    // Only evaluate descriptors not seen before in this optimization as
+    // breeding late in the annealing schedule produces many duplicates
+    const double unevaluated = std::numeric_limits<double>::quiet_NaN();
+    std::vector<unsigned> pending_descriptors;
+    std::vector<double> known_errors;
+    for (unsigned descriptor = 0; descriptor < descriptors.size();
+         ++descriptor) {
+      auto cached = fitness_cache.emplace(descriptors[descriptor], unevaluated);
+      if (cached.second) {
+        pending_descriptors.push_back(descriptor);
+      } else if (!std::isnan(cached.first->second)) {
+        known_errors.push_back(cached.first->second /
+                               kCrossValidationInnerRepeats);
+      }
+    }
+    cache_lookups += descriptors.size();
+    cache_hits += descriptors.size() - pending_descriptors.size();
+    
+    // The plan is only built once a generation has new descriptors
+    if (!pending_descriptors.empty() && !plan) {
+      plan.reset(new FoldPlan(stratified_data, kCrossValidationInnerFolds,
+                              kCrossValidationInnerRepeats, plan_seed));
+    }
+    
+    // Error of each inner cross validation repeat for new descriptors still
+    // in the race (i.e. not yet known to be unfit)
+    std::vector<std::vector<double>> repeat_errors(pending_descriptors.size());
+    
+    // Result of every fold trained for new descriptors, only kept when warm
+    // starting as it holds the weights of every trained network
+    std::vector<std::vector<FoldResult>> fold_results;
+    if (kWarmStartEnabled) {
+      fold_results.assign(pending_descriptors.size(),
+                          std::vector<FoldResult>(kCrossValidationInnerRepeats *
+                                                  kCrossValidationInnerFolds));
+    }
+    
+    std::vector<unsigned> racing(pending_descriptors.size());
+    std::iota(racing.begin(), racing.end(), 0);
+    
+    // Evaluates further repeats for every descriptor still in the race
+    auto evaluate_repeats = [&](int repeats) {
 #ifdef MULTITHREAD
-    std::mutex scored_descriptors_mutex;
-    std::mutex train_data_mutex;
-    std::vector<std::future<void>> threads;
-    
-    const unsigned num_threads = std::thread::hardware_concurrency();
-    const unsigned blocksize = static_cast<unsigned>(
-        descriptors.size() / num_threads);
-    
-    auto perform = [&](unsigned start, unsigned end) {
-      std::vector<FannTrainData> private_stratified_data;
-      {
-        std::lock_guard<std::mutex> lock(train_data_mutex);
-        private_stratified_data.reserve(stratified_data.size());
-        for (auto &data : stratified_data) {
-          private_stratified_data.push_back(FannTrainData(
-              fann_duplicate_train_data(data.get())));
+      // Each repeat is a separate task so the pool can balance descriptors of
+      // very different cost. The plan is never modified which allows every
+      // task to share it without copies or locks.
+      TaskGroup evaluations;
+      for (unsigned pending : racing) {
+        FannNetworkDescriptor &descriptor =
+            descriptors[pending_descriptors[pending]];
+        std::vector<double> &errors = repeat_errors[pending];
+        unsigned first_repeat = static_cast<unsigned>(errors.size());
+        errors.resize(first_repeat + repeats, 0.0);
+        for (int repeat = 0; repeat < repeats; ++repeat) {
+          double &error = errors[first_repeat + repeat];
+          int plan_repeat = static_cast<int>(first_repeat) + repeat;
+          std::vector<FoldResult> *results =
+              kWarmStartEnabled ? &fold_results[pending] : nullptr;
+          evaluations.Run([&, plan_repeat, results]() {
+            error = EvaluateRepeats(descriptor, *plan, plan_repeat, 1,
+                                    results).front();
+          });
+        }
+      }
+      evaluations.Wait();
+#else
+      for (unsigned pending : racing) {
+        FannNetworkDescriptor &descriptor =
+            descriptors[pending_descriptors[pending]];
+        std::vector<double> &errors = repeat_errors[pending];
+        std::vector<double> errors_of_repeats = EvaluateRepeats(
+            descriptor, *plan, static_cast<int>(errors.size()), repeats,
+            kWarmStartEnabled ? &fold_results[pending] : nullptr);
+        errors.insert(errors.end(), errors_of_repeats.begin(),
+                      errors_of_repeats.end());
+      }
+#endif
+    };
+    
+    // Drops descriptors whose lower confidence bound on the mean repeat error
+    // exceeds the upper bound of enough others to fill the mating population
+    auto drop_unfit = [&]() {
+      std::vector<double> lower_bounds(pending_descriptors.size());
+      std::vector<double> upper_bounds(known_errors);
+      for (unsigned pending : racing) {
+        const std::vector<double> &errors = repeat_errors[pending];
+        double count = static_cast<double>(errors.size());
+        double mean = std::accumulate(errors.begin(), errors.end(), 0.0) /
+            count;
+        double variance = 0.0;
+        for (double error : errors) {
+          variance += (error - mean) * (error - mean);
         }
+        variance /= std::max(count - 1.0, 1.0);
+        double bound = kRacingConfidence * std::sqrt(variance / count);
+        lower_bounds[pending] = mean - bound;
+        upper_bounds.push_back(mean + bound);
       }
-      for (unsigned descriptor = start; descriptor < end; ++descriptor) {
-        double error = 0;
-        FannNetwork network = descriptors[descriptor].CreateNetwork();
-        CrossValidation(private_stratified_data,
-                        [&](FannTrainData &training_data,
-                            FannTrainData &validation_data){
-          descriptors[descriptor].IntializeWeights(network, training_data);
-          error += static_cast<double>(TrainNetwork(
-              network, training_data, validation_data));
-        }, kCrossValidationInnerFolds, kCrossValidationInnerRepeats);
-        
-        std::lock_guard<std::mutex> lock(scored_descriptors_mutex);
-        scored_descriptors.push_back(
-            std::make_pair(descriptors[descriptor], error));
+      
+      if (upper_bounds.size() <=
+          static_cast<unsigned>(kNetworksMatingPerGeneration)) {
+        return;
       }
+      std::nth_element(upper_bounds.begin(),
+                       upper_bounds.begin() + kNetworksMatingPerGeneration - 1,
+                       upper_bounds.end());
+      double cutoff = upper_bounds[kNetworksMatingPerGeneration - 1];
+      racing.erase(std::remove_if(racing.begin(), racing.end(),
+                                  [&](unsigned pending) {
+        return lower_bounds[pending] > cutoff;
+      }), racing.end());
     };
     
-    for (unsigned thread = 1; thread < num_threads; ++thread) {
-      threads.emplace_back(std::async(
-          perform,
-          static_cast<unsigned>((thread - 1) * blocksize),
-          static_cast<unsigned>(thread * blocksize)));
+    // Evaluate fitness of each new descriptor in the population
+    const int round_repeats = kRacingEnabled
+        ? std::max(kRacingRepeatsPerRound, 2)
+        : kCrossValidationInnerRepeats;
+    for (int evaluated = 0;
+         evaluated < kCrossValidationInnerRepeats && !racing.empty();
+         evaluated += round_repeats) {
+      evaluate_repeats(std::min(round_repeats,
+                                kCrossValidationInnerRepeats - evaluated));
+      if (kRacingEnabled) {
+        drop_unfit();
+      }
     }
-    perform((num_threads - 1) * blocksize,
-            static_cast<unsigned>(descriptors.size()));
     
-    for (auto &thread : threads) {
-      thread.wait();
+    // Sum the errors in a fixed order so scores do not depend on scheduling,
+    // extrapolating the error of dropped descriptors to every repeat
+    // Note: Extrapolated errors only rank this generation and are kept out of
+    // the cache, so a dropped descriptor bred again is evaluated in full
+    std::unordered_map<FannNetworkDescriptor, double, FannNetworkDescriptorHash>
+        extrapolated_errors;
+    unsigned long generation_repeats = 0;
+#ifdef DEBUG
+    double start_errors[2] = {0.0, 0.0};
+    double start_epochs[2] = {0.0, 0.0};
+    unsigned long start_folds[2] = {0, 0};
+#endif
+    for (unsigned pending = 0; pending < pending_descriptors.size();
+         ++pending) {
+      const FannNetworkDescriptor &descriptor =
+          descriptors[pending_descriptors[pending]];
+      const std::vector<double> &errors = repeat_errors[pending];
+      double error = std::accumulate(errors.begin(), errors.end(), 0.0);
+      if (errors.size() <
+          static_cast<unsigned>(kCrossValidationInnerRepeats)) {
+        error *= static_cast<double>(kCrossValidationInnerRepeats) /
+            errors.size();
+        fitness_cache.erase(descriptor);
+        extrapolated_errors[descriptor] = error;
+      } else {
+        fitness_cache[descriptor] = error;
+      }
+      generation_repeats += errors.size();
+      
+      // Children bred from the descriptor inherit the weights it learnt on
+      // each fold of the plan
+      if (kWarmStartEnabled) {
+        std::vector<std::vector<fann_type>> fold_weights;
+        for (FoldResult &result : fold_results[pending]) {
+#ifdef DEBUG
+          if (result.best_epoch > 0) {
+            start_errors[result.warm] += result.error;
+            start_epochs[result.warm] += result.best_epoch;
+            ++start_folds[result.warm];
+          }
+#endif
+          fold_weights.push_back(std::move(result.weights));
+        }
+        descriptors[pending_descriptors[pending]].SetTrainedWeights(
+            std::move(fold_weights));
+      }
     }
-    threads.clear();
-#else
-    for (auto descriptor : descriptors) {
-      double error = 0;
-      FannNetwork network = descriptor.CreateNetwork();
-      CrossValidation(stratified_data, [&](FannTrainData &training_data,
-                                           FannTrainData &validation_data) {
-        descriptor.IntializeWeights(network, training_data);
-        error += static_cast<double>(TrainNetwork(network,
-                                                  training_data,
-                                                  validation_data));
-      }, kCrossValidationInnerFolds, kCrossValidationInnerRepeats);
-      scored_descriptors.push_back(std::make_pair(descriptor, error));
+    evaluated_repeats += generation_repeats;
+    
+    scored_descriptors.clear();
+    for (auto &descriptor : descriptors) {
+      auto cached = fitness_cache.find(descriptor);
+      scored_descriptors.push_back(std::make_pair(
+          descriptor, cached != fitness_cache.end()
+              ? cached->second : extrapolated_errors.at(descriptor)));
     }
-#endif
     
     // Sort descriptors by fitness
     std::sort(scored_descriptors.begin(), scored_descriptors.end(),
@@ -173,11 +384,48 @@ FannNetworkDescriptor EvolutionaryOptimize(
     std::cout << "Fittest network MSE: " << scored_descriptors[0].second
               << " (best MSE " << best_ever_score << ")" << std::endl;
     scored_descriptors[0].first.PrintDescription();
+    std::cout << "Fitness cache: "
+              << (descriptors.size() - pending_descriptors.size()) << "/"
+              << descriptors.size() << " hits (overall "
+              << (100.0 * cache_hits / cache_lookups) << "%)" << std::endl;
+    std::cout << "Racing: " << generation_repeats << "/"
+              << (pending_descriptors.size() * kCrossValidationInnerRepeats)
+              << " repeats evaluated (overall "
+              << (100.0 * evaluated_repeats /
+                  (cache_lookups * kCrossValidationInnerRepeats))
+              << "% of full budget)" << std::endl;
+    if (kWarmStartEnabled) {
+      const char *starts[] = {"Cold", "Warm"};
+      for (int warm = 0; warm < 2; ++warm) {
+        std::cout << starts[warm] << " starts: " << start_folds[warm]
+                  << " folds (mean MSE "
+                  << start_errors[warm] / std::max(start_folds[warm], 1ul)
+                  << ", mean epochs to best "
+                  << start_epochs[warm] / std::max(start_folds[warm], 1ul)
+                  << ")" << std::endl;
+      }
+    }
     std::cout << std::endl;
 #endif
     
     // Remove least-fit decriptors from the population
     scored_descriptors.resize(kNetworksMatingPerGeneration);
+    
+    if (checkpoint) {
+      EvolutionState state;
+      state.generation = generation + 1;
+      state.best_ever_score = best_ever_score;
+      state.plan_seed = plan_seed;
+      state.scored_descriptors = scored_descriptors;
+      for (auto &scored_descriptor : scored_descriptors) {
+        state.complete_scores.push_back(
+            fitness_cache.count(scored_descriptor.first) > 0);
+      }
+      std::ostringstream rng_state;
+      rng_state << rng << '\n' << GetDescriptorRngState();
+      state.rng_state = rng_state.str();
+      checkpoint(state);
+    }
   }
   
   // Get best network design descriptor
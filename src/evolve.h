@@ -21,22 +21,52 @@
 #ifndef EVOLVE_H_
 #define EVOLVE_H_
 
+#include <functional>
+#include <limits>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "fann_types.h"
 #include "network.h"
 
+/** Progress of ``EvolutionaryOptimize`` after a number of generations. */
+struct EvolutionState {
+  /** Number of completed generations. */
+  int generation = 0;
+  /** Lowest error of any descriptor so far. */
+  double best_ever_score = std::numeric_limits<float>::max();
+  /** Seed of the fold plan every descriptor of the run is evaluated against. */
+  unsigned plan_seed = 0;
+  /** Descriptors selected to breed the next generation with their error. */
+  std::vector<std::pair<FannNetworkDescriptor, double>> scored_descriptors;
+  /**
+    Whether each score was evaluated on every repeat rather than extrapolated
+    from the repeats evaluated before racing dropped the descriptor.
+  */
+  std::vector<bool> complete_scores;
+  /** State of the random number generators used for breeding. */
+  std::string rng_state;
+};
+
 /**
   \rst
   Applies an evolutionary approach to determine the optimal hyperparameters for
-  a FANN network returned as a ``FannNetworkDescriptor``.
+  a FANN network returned as a ``FannNetworkDescriptor``. When built with
+  ``MULTITHREAD`` descriptors are evaluated on the shared ``ThreadPool``.
 
+  The optional ``checkpoint`` function receives the state after each
+  generation. Passing a saved state as ``resume`` continues the optimization
+  from that generation.
+  
   ***Example**::
 
     FannNetworkDescriptor best_descriptor = EvolutionaryOptimize(data);
   \endrst
 */
 FannNetworkDescriptor EvolutionaryOptimize(
-    std::vector<FannTrainData> &stratified_data);
+    std::vector<FannTrainData> &stratified_data,
+    const std::function<void(const EvolutionState&)> &checkpoint = nullptr,
+    const EvolutionState *resume = nullptr);
 
 #endif // EVOLVE_H_
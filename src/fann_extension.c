@@ -20,6 +20,9 @@
 
 #include "fann_extension.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 int fann_set_train_data(struct fann_train_data* data,
                         unsigned num,
                         fann_type* input,
@@ -60,3 +63,160 @@ fann_type *fann_get_train_output(struct fann_train_data * data,
   
   return data->output[position];
 }
+
+struct fann_train_data *fann_create_train_view(unsigned num_data,
+                                               unsigned num_input,
+                                               unsigned num_output) {
+  
+  struct fann_train_data *data = (struct fann_train_data *)calloc(
+      1, sizeof(struct fann_train_data));
+  if (data == NULL) {
+    return NULL;
+  }
+  
+  data->num_data = num_data;
+  data->num_input = num_input;
+  data->num_output = num_output;
+  data->input = (fann_type **)calloc(num_data ? num_data : 1,
+                                     sizeof(fann_type *));
+  data->output = (fann_type **)calloc(num_data ? num_data : 1,
+                                      sizeof(fann_type *));
+  if (data->input == NULL || data->output == NULL) {
+    fann_destroy_train_view(data);
+    return NULL;
+  }
+  
+  return data;
+}
+
+void fann_set_train_view(struct fann_train_data *data,
+                         unsigned num,
+                         fann_type *input,
+                         fann_type *output) {
+  data->input[num] = input;
+  data->output[num] = output;
+}
+
+struct fann_train_data *fann_duplicate_train_view(
+    struct fann_train_data *data) {
+  
+  struct fann_train_data *copy = fann_create_train(data->num_data,
+                                                   data->num_input,
+                                                   data->num_output);
+  if (copy == NULL) {
+    return NULL;
+  }
+  
+  for (unsigned i = 0; i < data->num_data; ++i) {
+    fann_set_train_data(copy, i, data->input[i], data->output[i]);
+  }
+  
+  return copy;
+}
+
+void fann_destroy_train_view(struct fann_train_data *data) {
+  
+  if (data == NULL) {
+    return;
+  }
+  
+  free(data->input);
+  free(data->output);
+  free(data);
+}
+
+struct fann_train_data *fann_create_train_window(fann_type **input,
+                                                 fann_type **output,
+                                                 unsigned num_data,
+                                                 unsigned num_input,
+                                                 unsigned num_output) {
+  
+  struct fann_train_data *data = (struct fann_train_data *)calloc(
+      1, sizeof(struct fann_train_data));
+  if (data == NULL) {
+    return NULL;
+  }
+  
+  data->num_data = num_data;
+  data->num_input = num_input;
+  data->num_output = num_output;
+  data->input = input;
+  data->output = output;
+  
+  return data;
+}
+
+void fann_destroy_train_window(struct fann_train_data *data) {
+  
+  free(data);
+}
+
+int fann_allocate_train_arrays(struct fann *ann) {
+  const unsigned num_connections = ann->total_connections;
+  
+  switch (ann->training_algorithm) {
+    case FANN_TRAIN_INCREMENTAL:
+      if (ann->prev_weights_deltas == NULL) {
+        ann->prev_weights_deltas = (fann_type *)calloc(num_connections,
+                                                       sizeof(fann_type));
+      }
+      return ann->prev_weights_deltas == NULL ? -1 : 0;
+    case FANN_TRAIN_BATCH:
+      if (ann->train_slopes == NULL) {
+        ann->train_slopes = (fann_type *)calloc(num_connections,
+                                                sizeof(fann_type));
+      }
+      return ann->train_slopes == NULL ? -1 : 0;
+    default:
+      break;
+  }
+  
+  // Algorithms using previous steps clear every array (as
+  // fann_clear_train_arrays does) until the first epoch allocates them
+  if (ann->prev_train_slopes != NULL) {
+    return 0;
+  }
+  if (ann->train_slopes == NULL) {
+    ann->train_slopes = (fann_type *)calloc(num_connections,
+                                            sizeof(fann_type));
+  } else {
+    memset(ann->train_slopes, 0, num_connections * sizeof(fann_type));
+  }
+  if (ann->prev_steps == NULL) {
+    ann->prev_steps = (fann_type *)malloc(num_connections * sizeof(fann_type));
+  }
+  ann->prev_train_slopes = (fann_type *)calloc(num_connections,
+                                               sizeof(fann_type));
+  if (ann->train_slopes == NULL || ann->prev_steps == NULL ||
+      ann->prev_train_slopes == NULL) {
+    return -1;
+  }
+  
+  for (unsigned i = 0; i < num_connections; ++i) {
+    ann->prev_steps[i] = ann->training_algorithm == FANN_TRAIN_RPROP
+        ? ann->rprop_delta_zero : 0;
+  }
+  
+  return 0;
+}
+
+void fann_reset_train_arrays(struct fann *ann) {
+  const unsigned num_connections = ann->total_connections;
+  
+  if (ann->train_slopes != NULL) {
+    memset(ann->train_slopes, 0, num_connections * sizeof(fann_type));
+  }
+  if (ann->prev_train_slopes != NULL) {
+    memset(ann->prev_train_slopes, 0, num_connections * sizeof(fann_type));
+  }
+  if (ann->prev_steps != NULL) {
+    for (unsigned i = 0; i < num_connections; ++i) {
+      ann->prev_steps[i] = ann->training_algorithm == FANN_TRAIN_RPROP
+          ? ann->rprop_delta_zero : 0;
+    }
+  }
+  if (ann->prev_weights_deltas != NULL) {
+    memset(ann->prev_weights_deltas, 0, num_connections * sizeof(fann_type));
+  }
+  ann->sarprop_epoch = 0;
+}
@@ -49,6 +49,71 @@ fann_type *fann_get_train_input(struct fann_train_data * data,
 fann_type *fann_get_train_output(struct fann_train_data * data,
                                  unsigned position);
   
+/**
+  Creates a training data structure that references samples owned by another
+  structure instead of allocating storage for them. Must be released with
+  fann_destroy_train_view. Its rows need not be contiguous, so it must not be
+  passed to fann_duplicate_train_data, fann_subset_train_data or
+  fann_merge_train_data, which copy every sample from input[0]; copy it with
+  fann_duplicate_train_view instead
+*/
+struct fann_train_data *fann_create_train_view(unsigned num_data,
+                                               unsigned num_input,
+                                               unsigned num_output);
+
+/**
+  Points the specified position in a training data view at existing input and
+  desired output values
+*/
+void fann_set_train_view(struct fann_train_data *data,
+                         unsigned num,
+                         fann_type *input,
+                         fann_type *output);
+
+/**
+  Creates a training data structure holding its own copy of the samples
+  referenced by a training data view or window, copying each row separately
+*/
+struct fann_train_data *fann_duplicate_train_view(struct fann_train_data *data);
+
+/**
+  Destroys a training data view without freeing the referenced samples
+*/
+void fann_destroy_train_view(struct fann_train_data *data);
+  
+/**
+  Creates a training data view over consecutive entries of existing arrays of
+  input and output pointers, which must outlive it. Must be released with
+  fann_destroy_train_window and, like a view, copied with
+  fann_duplicate_train_view
+*/
+struct fann_train_data *fann_create_train_window(fann_type **input,
+                                                 fann_type **output,
+                                                 unsigned num_data,
+                                                 unsigned num_input,
+                                                 unsigned num_output);
+
+/**
+  Destroys a training data window without freeing the arrays it references
+*/
+void fann_destroy_train_window(struct fann_train_data *data);
+
+/**
+  Allocates the training arrays used by the network's training algorithm that
+  fann_train_epoch would allocate on its first epoch, initialising them the
+  same way. Arrays that already exist are left untouched. Returns -1 if
+  memory could not be allocated
+*/
+int fann_allocate_train_arrays(struct fann *ann);
+
+/**
+  Resets the training state left by earlier training to that of a new
+  network: existing slope and step arrays are cleared as
+  fann_clear_train_arrays would for the current training algorithm, previous
+  weight deltas (momentum) are zeroed and the SARPROP epoch restarts
+*/
+void fann_reset_train_arrays(struct fann *ann);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
@@ -25,16 +25,36 @@
 
 #include <memory>
 
+#include "fann_extension.h"
+
 /** \cond PRIVATE */
+void ReleasePooledNetwork(fann *ann);
+
 struct TrainDataDeleter {
+  bool view = false;  // Only references samples owned by other data
+  std::shared_ptr<void> owner;  // Kept alive while a view references it
+  bool window = false;  // Only references rows of another view
+  
   void operator()(fann_train_data* ptr) const {
-    fann_destroy_train(ptr);
+    if (window) {
+      fann_destroy_train_window(ptr);
+    } else if (view) {
+      fann_destroy_train_view(ptr);
+    } else {
+      fann_destroy_train(ptr);
+    }
   }
 };
 
 struct NetworkDeleter {
+  bool pooled = false;  // Returned to the network pool for reuse
+  
   void operator()(fann* ptr) const {
-    fann_destroy(ptr);
+    if (pooled) {
+      ReleasePooledNetwork(ptr);
+    } else {
+      fann_destroy(ptr);
+    }
   }
 };
 /** \endcond */
@@ -0,0 +1,356 @@
+/*
+  inference.cc
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "inference.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+const unsigned CompiledNetwork::kBlockSize;
+
+void ActivateNeurons(fann_activationfunc_enum activation_function,
+                     const fann_type *sums,
+                     fann_type *values,
+                     unsigned count) {
+  
+  // Linear interpolation between the points of FANN's stepwise functions
+  auto stepwise = [](const float (&v)[6], const float (&r)[6],
+                     float min, float max, float sum) {
+    auto linear = [&](int i) {
+      return (((r[i + 1] - r[i]) * (sum - v[i])) / (v[i + 1] - v[i]) + r[i]);
+    };
+    if (sum < v[4]) {
+      if (sum < v[2]) {
+        if (sum < v[1]) {
+          return sum < v[0] ? min : linear(0);
+        }
+        return linear(1);
+      }
+      return sum < v[3] ? linear(2) : linear(3);
+    }
+    return sum < v[5] ? linear(4) : max;
+  };
+  static const float kSigmoidStepwiseV[6] = {
+    -2.64665246009826660156e+00f, -1.47221946716308593750e+00f,
+    -5.49306154251098632812e-01f, 5.49306154251098632812e-01f,
+    1.47221934795379638672e+00f, 2.64665293693542480469e+00f,
+  };
+  static const float kSigmoidStepwiseR[6] = {
+    4.99999988824129104614e-03f, 5.00000007450580596924e-02f,
+    2.50000000000000000000e-01f, 7.50000000000000000000e-01f,
+    9.49999988079071044922e-01f, 9.95000004768371582031e-01f,
+  };
+  static const float kSigmoidSymmetricStepwiseV[6] = {
+    -2.64665293693542480469e+00f, -1.47221934795379638672e+00f,
+    -5.49306154251098632812e-01f, 5.49306154251098632812e-01f,
+    1.47221934795379638672e+00f, 2.64665293693542480469e+00f,
+  };
+  static const float kSigmoidSymmetricStepwiseR[6] = {
+    -9.90000009536743164062e-01f, -8.99999976158142089844e-01f,
+    -5.00000000000000000000e-01f, 5.00000000000000000000e-01f,
+    8.99999976158142089844e-01f, 9.90000009536743164062e-01f,
+  };
+  
+  const unsigned n = count;
+  switch (activation_function) {
+    case FANN_LINEAR:
+      for (unsigned s = 0; s < n; ++s) values[s] = sums[s];
+      break;
+    case FANN_THRESHOLD:
+      for (unsigned s = 0; s < n; ++s) values[s] = sums[s] < 0 ? 0 : 1;
+      break;
+    case FANN_THRESHOLD_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) values[s] = sums[s] < 0 ? -1 : 1;
+      break;
+    case FANN_SIGMOID:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = static_cast<fann_type>(
+            1.0f / (1.0f + std::exp(static_cast<double>(-2.0f * sums[s]))));
+      }
+      break;
+    case FANN_SIGMOID_STEPWISE:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = stepwise(kSigmoidStepwiseV, kSigmoidStepwiseR,
+                             0, 1, sums[s]);
+      }
+      break;
+    case FANN_SIGMOID_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = static_cast<fann_type>(
+            2.0f / (1.0f + std::exp(static_cast<double>(-2.0f * sums[s]))) -
+            1.0f);
+      }
+      break;
+    case FANN_SIGMOID_SYMMETRIC_STEPWISE:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = stepwise(kSigmoidSymmetricStepwiseV,
+                             kSigmoidSymmetricStepwiseR,
+                             -1, 1, sums[s]);
+      }
+      break;
+    case FANN_GAUSSIAN:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = static_cast<fann_type>(
+            std::exp(static_cast<double>(-sums[s] * sums[s])));
+      }
+      break;
+    case FANN_GAUSSIAN_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = static_cast<fann_type>(
+            std::exp(static_cast<double>(-sums[s] * sums[s])) * 2.0f - 1.0f);
+      }
+      break;
+    case FANN_GAUSSIAN_STEPWISE:
+      for (unsigned s = 0; s < n; ++s) values[s] = 0;
+      break;
+    case FANN_ELLIOT:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = (sums[s] / 2.0f) / (1.0f + std::fabs(sums[s])) + 0.5f;
+      }
+      break;
+    case FANN_ELLIOT_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = sums[s] / (1.0f + std::fabs(sums[s]));
+      }
+      break;
+    case FANN_LINEAR_PIECE:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = sums[s] < 0 ? 0 : (sums[s] > 1 ? 1 : sums[s]);
+      }
+      break;
+    case FANN_LINEAR_PIECE_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = sums[s] < -1 ? -1 : (sums[s] > 1 ? 1 : sums[s]);
+      }
+      break;
+    case FANN_SIN_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = static_cast<fann_type>(
+            std::sin(static_cast<double>(sums[s])));
+      }
+      break;
+    case FANN_COS_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = static_cast<fann_type>(
+            std::cos(static_cast<double>(sums[s])));
+      }
+      break;
+    case FANN_SIN:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = static_cast<fann_type>(
+            std::sin(static_cast<double>(sums[s])) / 2.0f + 0.5f);
+      }
+      break;
+    case FANN_COS:
+      for (unsigned s = 0; s < n; ++s) {
+        values[s] = static_cast<fann_type>(
+            std::cos(static_cast<double>(sums[s])) / 2.0f + 0.5f);
+      }
+      break;
+  }
+}
+
+CompiledNetwork::CompiledNetwork(FannNetwork &network) : max_layer_size_(0) {
+  const fann *ann = network.get();
+  
+  for (fann_layer *layer = ann->first_layer + 1; layer != ann->last_layer;
+       ++layer) {
+    fann_layer *previous_layer = layer - 1;
+    const unsigned num_input = static_cast<unsigned>(
+        previous_layer->last_neuron - previous_layer->first_neuron) - 1;
+    
+    // Every layer (including the output layer) ends with a bias neuron
+    const unsigned num_output = static_cast<unsigned>(
+        layer->last_neuron - layer->first_neuron) - 1;
+    
+    Layer compiled;
+    compiled.num_input = num_input;
+    compiled.num_output = num_output;
+    compiled.activation_function = layer->first_neuron->activation_function;
+    compiled.activation_steepness = layer->first_neuron->activation_steepness;
+    compiled.weights.resize(num_output * (num_input + 1));
+    
+    max_layer_size_ = std::max({max_layer_size_, num_input + 1, num_output});
+    layers_.push_back(std::move(compiled));
+  }
+  
+  UpdateWeights(network);
+}
+
+unsigned CompiledNetwork::NumInput() const {
+  return layers_.front().num_input;
+}
+
+unsigned CompiledNetwork::NumOutput() const {
+  return layers_.back().num_output;
+}
+
+void CompiledNetwork::Run(fann_type **input,
+                          unsigned num_samples,
+                          fann_type *output) const {
+  
+  // Reused between calls so small batches do not allocate
+  thread_local static std::vector<fann_type> scratch;
+  scratch.resize(std::max<std::size_t>(scratch.size(),
+                                       2 * max_layer_size_ * kBlockSize));
+  
+  for (unsigned sample = 0; sample < num_samples; sample += kBlockSize) {
+    RunBlock(input + sample, std::min(kBlockSize, num_samples - sample),
+             output + sample * NumOutput(), scratch);
+  }
+}
+
+void CompiledNetwork::Run(fann_type *input, fann_type *output) const {
+  Run(&input, 1, output);
+}
+
+float CompiledNetwork::MeanSquaredError(FannTrainData &data) const {
+  const fann_activationfunc_enum activation_function =
+      layers_.back().activation_function;
+  const bool symmetric =
+      activation_function == FANN_LINEAR_PIECE_SYMMETRIC ||
+      activation_function == FANN_THRESHOLD_SYMMETRIC ||
+      activation_function == FANN_SIGMOID_SYMMETRIC ||
+      activation_function == FANN_SIGMOID_SYMMETRIC_STEPWISE ||
+      activation_function == FANN_ELLIOT_SYMMETRIC ||
+      activation_function == FANN_GAUSSIAN_SYMMETRIC ||
+      activation_function == FANN_SIN_SYMMETRIC ||
+      activation_function == FANN_COS_SYMMETRIC;
+  
+  const unsigned num_samples = fann_length_train_data(data.get());
+  const unsigned num_output = NumOutput();
+  std::vector<fann_type> scratch(2 * max_layer_size_ * kBlockSize);
+  std::vector<fann_type> outputs(kBlockSize * num_output);
+  
+  // Accumulate in the same order and precision as fann_test_data
+  float error = 0.0f;
+  for (unsigned sample = 0; sample < num_samples; sample += kBlockSize) {
+    unsigned block_samples = std::min(kBlockSize, num_samples - sample);
+    RunBlock(data->input + sample, block_samples, outputs.data(), scratch);
+    for (unsigned s = 0; s < block_samples; ++s) {
+      for (unsigned output = 0; output < num_output; ++output) {
+        fann_type diff = data->output[sample + s][output] -
+            outputs[s * num_output + output];
+        if (symmetric) {
+          diff /= 2.0f;
+        }
+        error += diff * diff;
+      }
+    }
+  }
+  
+  unsigned num_errors = num_samples * num_output;
+  return num_errors > 0 ? error / static_cast<float>(num_errors) : 0.0f;
+}
+
+void CompiledNetwork::UpdateWeights(FannNetwork &network) {
+  const fann *ann = network.get();
+  
+  // Connections of a fully connected layer are stored contiguously
+  fann_layer *layer = ann->first_layer + 1;
+  for (Layer &compiled : layers_) {
+    const fann_type *weights = ann->weights + layer->first_neuron->first_con;
+    std::copy(weights, weights + compiled.weights.size(),
+              compiled.weights.begin());
+    ++layer;
+  }
+}
+
+void CompiledNetwork::RunBlock(fann_type **input,
+                               unsigned num_samples,
+                               fann_type *output,
+                               std::vector<fann_type> &scratch) const {
+  
+  // Neuron values are stored transposed (neuron major) so each step of the
+  // kernels operates on the same neuron across every sample in the block
+  fann_type *values = scratch.data();
+  fann_type *next_values = values + max_layer_size_ * kBlockSize;
+  
+  const unsigned num_input = NumInput();
+  for (unsigned neuron = 0; neuron < num_input; ++neuron) {
+    for (unsigned s = 0; s < kBlockSize; ++s) {
+      values[neuron * kBlockSize + s] = s < num_samples
+          ? input[s][neuron] : 0;
+    }
+  }
+  
+  for (const Layer &layer : layers_) {
+    
+    // Bias neuron
+    std::fill_n(values + layer.num_input * kBlockSize, kBlockSize, 1.0f);
+    
+    const unsigned num_connections = layer.num_input + 1;
+    const fann_type steepness = layer.activation_steepness;
+    const fann_type max_sum = 150 / steepness;
+    for (unsigned neuron = 0; neuron < layer.num_output; ++neuron) {
+      const fann_type *weights = layer.weights.data() +
+          neuron * num_connections;
+      
+      // Accumulate in the same order as fann_run
+      fann_type sums[kBlockSize] = {};
+      unsigned i = num_connections & 3;
+      switch (i) {
+        case 3:
+          for (unsigned s = 0; s < kBlockSize; ++s) {
+            sums[s] += weights[2] * values[2 * kBlockSize + s];
+          }
+          // fall through
+        case 2:
+          for (unsigned s = 0; s < kBlockSize; ++s) {
+            sums[s] += weights[1] * values[1 * kBlockSize + s];
+          }
+          // fall through
+        case 1:
+          for (unsigned s = 0; s < kBlockSize; ++s) {
+            sums[s] += weights[0] * values[s];
+          }
+          // fall through
+        case 0:
+          break;
+      }
+      for (; i != num_connections; i += 4) {
+        const fann_type *block = values + i * kBlockSize;
+        for (unsigned s = 0; s < kBlockSize; ++s) {
+          sums[s] += weights[i] * block[s] +
+              weights[i + 1] * block[kBlockSize + s] +
+              weights[i + 2] * block[2 * kBlockSize + s] +
+              weights[i + 3] * block[3 * kBlockSize + s];
+        }
+      }
+      
+      for (unsigned s = 0; s < kBlockSize; ++s) {
+        fann_type sum = steepness * sums[s];
+        sums[s] = sum > max_sum ? max_sum : (sum < -max_sum ? -max_sum : sum);
+      }
+      ActivateNeurons(layer.activation_function, sums,
+                      next_values + neuron * kBlockSize, kBlockSize);
+    }
+    
+    std::swap(values, next_values);
+  }
+  
+  const unsigned num_output = NumOutput();
+  for (unsigned s = 0; s < num_samples; ++s) {
+    for (unsigned neuron = 0; neuron < num_output; ++neuron) {
+      output[s * num_output + neuron] = values[neuron * kBlockSize + s];
+    }
+  }
+}
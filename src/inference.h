@@ -0,0 +1,109 @@
+/*
+  inference.h
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INFERENCE_H_
+#define INFERENCE_H_
+
+#include <fann.h>
+
+#include <vector>
+
+#include "fann_types.h"
+
+/**
+  Applies an activation function to ``count`` neuron sums (already scaled by
+  the steepness). Formulas mirror the floating point variants of FANN's
+  activation macros, including their use of double precision maths functions.
+*/
+void ActivateNeurons(fann_activationfunc_enum activation_function,
+                     const fann_type *sums,
+                     fann_type *values,
+                     unsigned count);
+
+/**
+  \rst
+  A fully connected ``FannNetwork`` compiled into contiguous per-layer weight
+  matrices for batched inference. Samples are evaluated in blocks with the
+  neurons of each layer computed for every sample in the block at once, which
+  lets the compiler vectorise the kernels. Sums are accumulated in the same
+  order as ``fann_run`` and activations use the same formulas, so outputs
+  match FANN to within floating point tolerance.
+  
+  The network must be created with ``fann_create_standard_array`` (so every
+  neuron connects to all neurons and the bias of the previous layer) and use
+  the same activation function and steepness for every neuron of a layer, as
+  networks created by ``FannNetworkDescriptor`` do.
+  
+  ***Example**::
+  
+    CompiledNetwork compiled(network);
+    std::vector<fann_type> outputs(num_samples * compiled.NumOutput());
+    compiled.Run(data->input, num_samples, outputs.data());
+  \endrst
+*/
+class CompiledNetwork {
+ public:
+  /** Number of samples evaluated together by the kernels. */
+  static const unsigned kBlockSize = 8;
+  
+  /** Compile the current weights of a network. */
+  explicit CompiledNetwork(FannNetwork &network);
+  
+  /** Number of inputs. */
+  unsigned NumInput() const;
+  
+  /** Number of outputs. */
+  unsigned NumOutput() const;
+  
+  /**
+    Evaluate a batch of samples. ``input`` holds a pointer to the features of
+    each sample and ``output`` receives ``num_samples`` rows of outputs.
+  */
+  void Run(fann_type **input, unsigned num_samples, fann_type *output) const;
+  
+  /** Evaluate a single sample. */
+  void Run(fann_type *input, fann_type *output) const;
+  
+  /**
+    Mean squared error over a data set, computed as ``fann_test_data`` does
+    (halving the error of symmetric output activation functions).
+  */
+  float MeanSquaredError(FannTrainData &data) const;
+  
+  /** Replace the weights with those of a network of the same topology. */
+  void UpdateWeights(FannNetwork &network);
+  
+ private:
+  struct Layer {
+    unsigned num_input;  // Excluding the bias
+    unsigned num_output;
+    fann_activationfunc_enum activation_function;
+    fann_type activation_steepness;
+    std::vector<fann_type> weights;  // Row per output, bias weight last
+  };
+  
+  void RunBlock(fann_type **input, unsigned num_samples, fann_type *output,
+                std::vector<fann_type> &scratch) const;
+  
+  std::vector<Layer> layers_;
+  unsigned max_layer_size_;
+};
+
+#endif // INFERENCE_H_
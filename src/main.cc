@@ -21,10 +21,18 @@
 #include <fann.h>
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <numeric>
+#include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "checkpoint.h"
 #include "config.h"
 #include "crossvalidate.h"
 #include "data.h"
@@ -32,9 +40,15 @@
 #include "evolve.h"
 #include "fann_extension.h"
 #include "fann_types.h"
+#include "inference.h"
 #include "network.h"
+#include "profile.h"
 #include "train.h"
 
+// Folds of the cross validation generating the ensemble (i.e. networks in
+// each repeat)
+static const int kEnsembleFolds = 10;
+
 /** Returns resection status (complete=1, incomplete=0) for a given sample. */
 unsigned resectionStatusHelper(float *input, float *output) {
   return *output >= 0.5f ? 0 : 1;
@@ -44,46 +58,134 @@ int main(int argc, char **argv) {
 
   // Load and combine the data sets
   std::vector<std::string> file_paths(argv + 1, argv + argc);
-  FannTrainData data_combined = LoadTrainData(file_paths);
+  std::vector<TrainDataFileStats> file_stats;
+  FannTrainData data_combined = LoadTrainData(file_paths, &file_stats);
   if (!data_combined) {
     std::cout << "Usage: train datafile1 datafile2 ..." << std::endl;
     return 0;
   }
   unsigned num_samples = fann_length_train_data(data_combined.get());
   std::cout << "Loaded " << num_samples << " samples" << std::endl;
+  for (const TrainDataFileStats &stats : file_stats) {
+    if (stats.bytes == 0) {
+      continue;  // Memory mapped without parsing
+    }
+    std::cout << "  " << stats.path << ": " << stats.num_samples
+              << " samples in " << (stats.seconds * 1000.0) << " ms ("
+              << (stats.bytes / 1e6 / std::max(stats.seconds, 1e-9))
+              << " MB/s)" << std::endl;
+  }
   
-  // Outer cross validation loop for network evaluation stratified by
-  // resection status
-  std::vector<FannTrainData> resection_data = StratifyTrainData(
-      data_combined, 2, resectionStatusHelper);
-  CrossValidation(resection_data, [](FannTrainData &training_data,
-                                     FannTrainData &testing_data,
-                                     int fold, int repeat) {
+  // Progress is saved so an interrupted pipeline resumes where it stopped
+  Checkpoint checkpoint("models/checkpoint.bin", data_combined, file_paths);
+  
+  // Develops a model on the training data of a single outer cross validation
+  // run and saves its predictions for the testing data
+  auto perform_run = [&checkpoint](FannTrainData &training_data,
+                                   FannTrainData &testing_data,
+                                   int run) {
     
     // Network selection using evolution to find the best network design
     // (hides inner cross validation loop)
     std::vector<FannTrainData> resection_data = StratifyTrainData(
         training_data, 2, resectionStatusHelper);
+    EvolutionState resume_state;
+    bool resume = checkpoint.GetEvolutionState(run, resume_state);
     FannNetworkDescriptor best_descriptor = EvolutionaryOptimize(
-        resection_data);
+        resection_data, [&](const EvolutionState &state) {
+      checkpoint.SetEvolutionState(run, state);
+    }, resume ? &resume_state : nullptr);
     
     // Generate stacked ensemble with the best network design found
     // Note: Cross validation is used as a convenience to create the ensemble
-    Ensemble ensemble;
-    auto network = best_descriptor.CreateNetwork();
-    CrossValidation(resection_data, [&](FannTrainData &training_data_subsample,
-                                        FannTrainData &validation_data) {
+    // Note: Members are trained in parallel and added in order of repeat and
+    // fold, so the ensemble does not depend on scheduling. Packed ensembles
+    // copy the weights of each member as it is added, so the network returns
+    // to the pool for a later member.
+    // Note: When pruning, each member predicts its validation fold, giving
+    // every repeat an out-of-fold prediction of each sample (written by one
+    // task only)
+    const bool prune = kEnsemblePrunedSize < kEnsembleSize;
+    unsigned num_output = fann_num_output_train_data(training_data.get());
+    std::unordered_map<const fann_type*, unsigned> sample_index;
+    std::vector<float> targets;
+    std::vector<std::vector<float>> repeat_predictions;
+    if (prune) {
+      for (FannTrainData &stratum : resection_data) {
+        for (unsigned sample = 0; sample < stratum->num_data; ++sample) {
+          sample_index[stratum->input[sample]] = static_cast<unsigned>(
+              targets.size() / num_output);
+          targets.insert(targets.end(), stratum->output[sample],
+                         stratum->output[sample] + num_output);
+        }
+      }
+      repeat_predictions.assign(kEnsembleSize,
+                                std::vector<float>(targets.size()));
+    }
+    Ensemble ensemble(EnsembleStorage::kPacked);
+    ParallelCrossValidation(
+        resection_data, [&](FannTrainData &training_data_subsample,
+                            FannTrainData &validation_data,
+                            int fold, int repeat) {
+      FannNetwork network = best_descriptor.CreateNetwork();
       best_descriptor.IntializeWeights(network, training_data_subsample);
       TrainNetwork(network, training_data_subsample, validation_data);
-      ensemble.Add(FannNetwork(fann_copy(network.get())));
-    }, 10, kEnsembleSize);
+      
+      if (prune) {
+        unsigned num_validation = validation_data->num_data;
+        std::vector<fann_type> outputs(num_validation * num_output);
+        CompiledNetwork(network).Run(validation_data->input, num_validation,
+                                     outputs.data());
+        for (unsigned sample = 0; sample < num_validation; ++sample) {
+          unsigned index = sample_index.at(validation_data->input[sample]);
+          std::copy_n(outputs.begin() + sample * num_output, num_output,
+                      repeat_predictions[repeat].begin() + index * num_output);
+        }
+      }
+      return network;
+    }, [&](FannNetwork network, int fold, int repeat) {
+      ensemble.Add(std::move(network));
+    }, kEnsembleFolds, kEnsembleSize);
+    
+    // Prune the ensemble to the repeats whose averaged out-of-fold
+    // predictions come closest to those of every repeat (when enabled)
+    // Note: The repeats are chosen on the predictions their error is measured
+    // on, so the error of the pruned ensemble is in-sample (i.e. optimistic)
+    if (prune) {
+      std::vector<unsigned> all_repeats(kEnsembleSize);
+      std::iota(all_repeats.begin(), all_repeats.end(), 0u);
+      std::vector<unsigned> selected_repeats = SelectEnsembleMembers(
+          repeat_predictions, targets, kEnsemblePrunedSize,
+          kEnsemblePruningTolerance);
+      std::sort(selected_repeats.begin(), selected_repeats.end());
+      double full_error = EnsembleMeanSquaredError(repeat_predictions,
+                                                   all_repeats, targets);
+      double pruned_error = EnsembleMeanSquaredError(
+          repeat_predictions, selected_repeats, targets);
+      std::vector<unsigned> selected_members;
+      for (unsigned repeat : selected_repeats) {
+        for (int fold = 0; fold < kEnsembleFolds; ++fold) {
+          selected_members.push_back(repeat * kEnsembleFolds + fold);
+        }
+      }
+      Ensemble pruned = ensemble.Select(selected_members);
+      unsigned full_size = ensemble.Size();
+      ensemble = std::move(pruned);
+      std::ostringstream pruning;
+      pruning << "Run " << run << ": pruned ensemble from " << full_size
+              << " to " << ensemble.Size() << " networks ("
+              << (static_cast<double>(full_size) / ensemble.Size())
+              << "x fewer forward passes), out-of-fold MSE " << full_error
+              << " -> " << pruned_error << " (in-sample, as the repeats "
+              << "were selected on the same predictions)" << std::endl;
+      std::cout << pruning.str();
+    }
     
     // Make predictions with stacked ensemble on testing data
     std::vector<std::vector<float>> predictions_ann = ensemble.Predict(
         testing_data);
     
     // Save predictions and training data
-    int run = fold * kCrossValidationOuterFolds + repeat;
     unsigned input_size = fann_num_input_train_data(training_data.get());
     unsigned output_size = fann_num_output_train_data(training_data.get());
     std::vector<std::string> train_header;
@@ -99,8 +201,96 @@ int main(int argc, char **argv) {
              GetTrainDataValues(testing_data), train_header);
     WriteCsv("models/predict-ann-" + std::to_string(run) + ".csv",
              predictions_ann, { "predict0" });
+    ensemble.Save("models/ensemble-" + std::to_string(run) + ".bin");
+    checkpoint.CompleteRun(run);
+  };
     
-  }, kCrossValidationOuterFolds, kCrossValidationOuterRepeats);
+#ifdef MULTITHREAD
+  // Concurrent runs share the threads of the pool used to evaluate descriptors
+  const unsigned concurrent_runs = static_cast<unsigned>(
+      std::max(kCrossValidationOuterConcurrency, 1));
+  std::vector<std::future<void>> runs;
+  std::mutex runs_mutex;
+  std::condition_variable run_finished;
+  unsigned active_runs = 0;
+  auto finish_run = [&]() {
+    std::lock_guard<std::mutex> lock(runs_mutex);
+    --active_runs;
+    run_finished.notify_one();
+  };
+#endif
   
+  // Outer cross validation loop for network evaluation stratified by
+  // resection status
+  std::vector<FannTrainData> resection_data = StratifyTrainData(
+      data_combined, 2, resectionStatusHelper);
+  CrossValidation(resection_data, [&](FannTrainData &training_data,
+                                      FannTrainData &testing_data,
+                                      int fold, int repeat) {
+    int run = fold * kCrossValidationOuterFolds + repeat;
+    if (checkpoint.IsRunComplete(run)) {
+      std::cout << "Skipping completed run " << run << std::endl;
+      return;
+    }
+#ifdef MULTITHREAD
+    if (concurrent_runs > 1) {
+      
+      // Wait for whichever run finishes first when every slot is in use
+      {
+        std::unique_lock<std::mutex> lock(runs_mutex);
+        run_finished.wait(lock, [&]() {
+          return active_runs < concurrent_runs;
+        });
+        ++active_runs;
+      }
+      
+      // Collect finished runs so their errors are raised promptly
+      runs.erase(std::remove_if(runs.begin(), runs.end(),
+                                [](std::future<void> &run) {
+        if (run.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready) {
+          return false;
+        }
+        run.get();
+        return true;
+      }), runs.end());
+      
+      // Views into the strata are only valid during this call so each run
+      // takes its own copy of the data
+      auto training_copy = FannTrainData(fann_duplicate_train_view(
+          training_data.get()));
+      auto testing_copy = FannTrainData(fann_duplicate_train_view(
+          testing_data.get()));
+      runs.emplace_back(std::async(
+          std::launch::async,
+          [&perform_run, &finish_run, run,
+           training_copy = std::move(training_copy),
+           testing_copy = std::move(testing_copy)]() mutable {
+        try {
+          perform_run(training_copy, testing_copy, run);
+        } catch (...) {
+          finish_run();
+          throw;
+        }
+        finish_run();
+      }));
+      return;
+    }
+#endif
+    perform_run(training_data, testing_data, run);
+  }, kCrossValidationOuterFolds, kCrossValidationOuterRepeats,
+      CVFoldMode::kView, checkpoint.Seed());
+  
+#ifdef MULTITHREAD
+  for (auto &run : runs) {
+    run.get();
+  }
+#endif
+  checkpoint.Remove();
+  
+#ifdef PROFILE
+  WriteProfile("models/profile.json");
+#endif
+
   return 0;
 }
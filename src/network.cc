@@ -23,12 +23,44 @@
 #include <algorithm>
 #include <array>
 #include <cmath>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <random>
+#include <sstream>
 #include <vector>
 
+#include "profile.h"
+
 thread_local static std::mt19937 rng{std::random_device{}()};
 
+// Upper bound on layers accepted when reading a serialized descriptor
+static const unsigned kMaxSerializedLayers = 1024;
+
+// Upper bound on networks kept for reuse by each thread
+static const unsigned kMaxPooledNetworks = 64;
+
+// Set once the pool of the thread is destroyed so networks released later by
+// other thread local objects are freed instead
+thread_local static bool network_pool_destroyed = false;
+
+// Networks released by a thread grouped by layer sizes
+struct NetworkPool {
+  std::map<std::vector<unsigned>, std::vector<fann*>> networks;
+  unsigned size = 0;
+  
+  ~NetworkPool() {
+    for (auto &topology : networks) {
+      for (fann *ann : topology.second) {
+        fann_destroy(ann);
+      }
+    }
+    network_pool_destroyed = true;
+  }
+};
+thread_local static NetworkPool network_pool;
+
 FannNetworkDescriptor::FannNetworkDescriptor(unsigned input_size,
                                              unsigned output_size)
     : num_input_(input_size), num_output_(output_size) {
@@ -36,8 +68,8 @@ FannNetworkDescriptor::FannNetworkDescriptor(unsigned input_size,
 }
   
 FannNetwork FannNetworkDescriptor::CreateNetwork() {
-  auto ann = FannNetwork(fann_create_standard_array(
-      static_cast<unsigned>(layers_.size()), layers_.data()));
+  PROFILE_SCOPE(ProfilePhase::kCreateNetwork);
+  auto ann = AcquirePooledNetwork(layers_);
   
   for (unsigned layer = 1; layer < layers_.size(); ++layer) {
     fann_set_activation_steepness_layer(ann.get(),
@@ -68,11 +100,15 @@ FannNetwork FannNetworkDescriptor::CreateNetwork() {
   fann_set_sarprop_step_error_threshold_factor(
       ann.get(), sarprop_step_error_threshold_factor_);
   
+  // Initial steps of a pooled network depend on the training algorithm
+  fann_reset_train_arrays(ann.get());
+  
   return ann;
 }
   
 void FannNetworkDescriptor::IntializeWeights(FannNetwork& ann,
                                              FannTrainData& train_data) {
+  PROFILE_SCOPE(ProfilePhase::kInitializeWeights);
   if (wn_weight_init_) {
     fann_init_weights(ann.get(), train_data.get());
   } else {
@@ -80,6 +116,33 @@ void FannNetworkDescriptor::IntializeWeights(FannNetwork& ann,
   }
 }
   
+void FannNetworkDescriptor::SetTrainedWeights(
+    std::vector<std::vector<fann_type>> fold_weights) {
+  trained_weights_ =
+      std::make_shared<const std::vector<std::vector<fann_type>>>(
+          std::move(fold_weights));
+  trained_layers_ = layers_;
+}
+
+bool FannNetworkDescriptor::WarmStartWeights(FannNetwork& ann,
+                                             unsigned fold) const {
+  if (!HasTrainedWeights() || fold >= trained_weights_->size() ||
+      (*trained_weights_)[fold].size() != ann->total_connections) {
+    return false;
+  }
+  PROFILE_SCOPE(ProfilePhase::kInitializeWeights);
+  const std::vector<fann_type> &weights = (*trained_weights_)[fold];
+  std::copy(weights.begin(), weights.end(), ann->weights);
+  
+  // Training continues from the weights alone, as after fann_randomize_weights
+  fann_reset_train_arrays(ann.get());
+  return true;
+}
+
+bool FannNetworkDescriptor::HasTrainedWeights() const {
+  return trained_weights_ && trained_layers_ == layers_;
+}
+
 void FannNetworkDescriptor::Reset() {
   learning_momentum_ = 0.f;
   learning_rate_ = 0.7f;
@@ -112,6 +175,9 @@ void FannNetworkDescriptor::Reset() {
   wn_weight_init_ = false;
   min_weight_ = -0.1f;
   max_weight_ = 0.1f;
+  
+  trained_weights_.reset();
+  trained_layers_.clear();
 }
   
 void FannNetworkDescriptor::Merge(const FannNetworkDescriptor &descriptor) {
@@ -192,6 +258,12 @@ void FannNetworkDescriptor::Merge(const FannNetworkDescriptor &descriptor) {
   layers_ = new_layers_;
   layer_activation_funcs_ = new_layer_activation_funcs_;
   layer_activation_steepness_ = new_layer_activation_steepness_;
+  
+  // Inherit the other parent's trained weights when only they still fit
+  if (trained_layers_ != layers_ && descriptor.trained_layers_ == layers_) {
+    trained_weights_ = descriptor.trained_weights_;
+    trained_layers_ = descriptor.trained_layers_;
+  }
 }
 
 void FannNetworkDescriptor::Mutate(float small_chance,
@@ -396,3 +468,249 @@ void FannNetworkDescriptor::PrintDescription() {
   }
   std::cout << std::endl;
 }
+
+std::size_t FannNetworkDescriptor::Hash() const {
+  std::size_t hash = 0;
+  auto combine = [&](std::size_t value) {
+    hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  };
+  
+  combine(std::hash<unsigned>()(num_input_));
+  combine(std::hash<unsigned>()(num_output_));
+  combine(std::hash<int>()(training_algorithm_));
+  combine(std::hash<bool>()(wn_weight_init_));
+  for (unsigned layer = 0; layer < layers_.size(); ++layer) {
+    combine(std::hash<unsigned>()(layers_[layer]));
+  }
+  for (unsigned layer = 0; layer < layer_activation_funcs_.size(); ++layer) {
+    combine(std::hash<int>()(layer_activation_funcs_[layer]));
+    combine(std::hash<float>()(layer_activation_steepness_[layer]));
+  }
+  for (float hyperparameter : EffectiveHyperparameters()) {
+    combine(std::hash<float>()(hyperparameter));
+  }
+  
+  return hash;
+}
+
+bool FannNetworkDescriptor::operator==(
+    const FannNetworkDescriptor &descriptor) const {
+  return num_input_ == descriptor.num_input_ &&
+      num_output_ == descriptor.num_output_ &&
+      training_algorithm_ == descriptor.training_algorithm_ &&
+      wn_weight_init_ == descriptor.wn_weight_init_ &&
+      layers_ == descriptor.layers_ &&
+      layer_activation_funcs_ == descriptor.layer_activation_funcs_ &&
+      layer_activation_steepness_ == descriptor.layer_activation_steepness_ &&
+      EffectiveHyperparameters() == descriptor.EffectiveHyperparameters();
+}
+
+bool FannNetworkDescriptor::operator!=(
+    const FannNetworkDescriptor &descriptor) const {
+  return !(*this == descriptor);
+}
+
+void FannNetworkDescriptor::Serialize(std::ostream &stream) const {
+  auto write = [&](const auto &value) {
+    stream.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  };
+  auto write_vector = [&](const auto &values) {
+    write(static_cast<unsigned>(values.size()));
+    for (const auto &value : values) {
+      write(value);
+    }
+  };
+  
+  write(num_input_);
+  write(num_output_);
+  write(learning_momentum_);
+  write(learning_rate_);
+  write(training_algorithm_);
+  write_vector(layers_);
+  write_vector(layer_activation_funcs_);
+  write_vector(layer_activation_steepness_);
+  write(quickprop_decay_);
+  write(quickprop_mu_);
+  write(rprop_increase_factor_);
+  write(rprop_decrease_factor_);
+  write(rprop_delta_min_);
+  write(rprop_delta_max_);
+  write(rprop_delta_zero_);
+  write(sarprop_temperature_);
+  write(sarprop_weight_decay_shift_);
+  write(sarprop_step_error_shift_);
+  write(sarprop_step_error_threshold_factor_);
+  write(wn_weight_init_);
+  write(min_weight_);
+  write(max_weight_);
+}
+
+bool FannNetworkDescriptor::Deserialize(std::istream &stream) {
+  auto read = [&](auto &value) {
+    stream.read(reinterpret_cast<char*>(&value), sizeof(value));
+  };
+  auto read_vector = [&](auto &values) {
+    unsigned size = 0;
+    read(size);
+    if (size > kMaxSerializedLayers) {
+      stream.setstate(std::ios::failbit);  // Corrupt rather than huge
+    }
+    values.resize(stream ? size : 0);
+    for (auto &value : values) {
+      read(value);
+    }
+  };
+  
+  read(num_input_);
+  read(num_output_);
+  read(learning_momentum_);
+  read(learning_rate_);
+  read(training_algorithm_);
+  read_vector(layers_);
+  read_vector(layer_activation_funcs_);
+  read_vector(layer_activation_steepness_);
+  read(quickprop_decay_);
+  read(quickprop_mu_);
+  read(rprop_increase_factor_);
+  read(rprop_decrease_factor_);
+  read(rprop_delta_min_);
+  read(rprop_delta_max_);
+  read(rprop_delta_zero_);
+  read(sarprop_temperature_);
+  read(sarprop_weight_decay_shift_);
+  read(sarprop_step_error_shift_);
+  read(sarprop_step_error_threshold_factor_);
+  read(wn_weight_init_);
+  read(min_weight_);
+  read(max_weight_);
+  if (!stream) {
+    return false;
+  }
+  
+  // Reject configurations CreateNetwork would index past or pass to FANN as
+  // unknown enumerators
+  if (static_cast<unsigned>(training_algorithm_) > FANN_TRAIN_SARPROP ||
+      layers_.size() < 2 ||
+      layers_.front() != num_input_ ||
+      layers_.back() != num_output_ ||
+      layer_activation_funcs_.size() != layers_.size() - 1 ||
+      layer_activation_steepness_.size() != layers_.size() - 1) {
+    return false;
+  }
+  for (unsigned layer_size : layers_) {
+    if (layer_size == 0) {
+      return false;
+    }
+  }
+  for (fann_activationfunc_enum activation_func : layer_activation_funcs_) {
+    if (static_cast<unsigned>(activation_func) > FANN_COS) {
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+std::vector<float> FannNetworkDescriptor::EffectiveHyperparameters() const {
+  std::vector<float> hyperparameters;
+  
+  // Only include the hyperparameters FANN reads for the training algorithm
+  switch (training_algorithm_) {
+    case FANN_TRAIN_INCREMENTAL:
+      hyperparameters = {learning_rate_, learning_momentum_};
+      break;
+    case FANN_TRAIN_BATCH:
+      hyperparameters = {learning_rate_};
+      break;
+    case FANN_TRAIN_RPROP:
+      hyperparameters = {rprop_increase_factor_,
+                         rprop_decrease_factor_,
+                         rprop_delta_min_,
+                         rprop_delta_max_,
+                         rprop_delta_zero_};
+      break;
+    case FANN_TRAIN_QUICKPROP:
+      hyperparameters = {learning_rate_, quickprop_decay_, quickprop_mu_};
+      break;
+    case FANN_TRAIN_SARPROP:
+      hyperparameters = {rprop_increase_factor_,
+                         rprop_decrease_factor_,
+                         rprop_delta_max_,
+                         sarprop_weight_decay_shift_,
+                         sarprop_step_error_threshold_factor_,
+                         sarprop_step_error_shift_,
+                         sarprop_temperature_};
+      break;
+  }
+  
+  // Weight limits are unused by Widrow and Nguyen's initialisation
+  if (!wn_weight_init_) {
+    hyperparameters.push_back(min_weight_);
+    hyperparameters.push_back(max_weight_);
+  }
+  
+  return hyperparameters;
+}
+
+FannNetwork AcquirePooledNetwork(const std::vector<unsigned> &layers) {
+  if (!network_pool_destroyed) {
+    auto topology = network_pool.networks.find(layers);
+    if (topology != network_pool.networks.end()) {
+      fann *ann = topology->second.back();
+      topology->second.pop_back();
+      if (topology->second.empty()) {
+        network_pool.networks.erase(topology);
+      }
+      --network_pool.size;
+      fann_reset_train_arrays(ann);
+      return FannNetwork(ann, NetworkDeleter{true});
+    }
+  }
+  
+  return FannNetwork(fann_create_standard_array(
+      static_cast<unsigned>(layers.size()), layers.data()),
+                     NetworkDeleter{true});
+}
+
+void ReleasePooledNetwork(fann *ann) {
+  if (network_pool_destroyed) {
+    fann_destroy(ann);
+    return;
+  }
+  
+  std::vector<unsigned> layers(fann_get_num_layers(ann));
+  fann_get_layer_array(ann, layers.data());
+  
+  // Make room by freeing a network of another topology, as topologies bred
+  // in earlier generations are unlikely to be requested again. A full pool
+  // of this topology already holds more networks than are reused at once
+  if (network_pool.size >= kMaxPooledNetworks) {
+    auto evicted = network_pool.networks.begin();
+    if (evicted->first == layers) {
+      ++evicted;
+    }
+    if (evicted == network_pool.networks.end()) {
+      fann_destroy(ann);
+      return;
+    }
+    fann_destroy(evicted->second.back());
+    evicted->second.pop_back();
+    if (evicted->second.empty()) {
+      network_pool.networks.erase(evicted);
+    }
+    --network_pool.size;
+  }
+  
+  network_pool.networks[layers].push_back(ann);
+  ++network_pool.size;
+}
+
+std::string GetDescriptorRngState() {
+  std::ostringstream state;
+  state << rng;
+  return state.str();
+}
+
+void SetDescriptorRngState(const std::string &state) {
+  std::istringstream(state) >> rng;
+}
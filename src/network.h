@@ -23,6 +23,11 @@
 
 #include <fann.h>
 
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
 #include <vector>
 
 #include "fann_types.h"
@@ -33,12 +38,36 @@ class FannNetworkDescriptor {
   /** Create a descriptor with a default configuration. */
   FannNetworkDescriptor(unsigned input_size = 1, unsigned output_size = 1);
   
-  /** Create a ``FannNetwork`` object using the descriptor. */
+  /**
+    Create a ``FannNetwork`` object using the descriptor. Networks come from
+    the pool of the calling thread so weights must be initialised before use.
+  */
   FannNetwork CreateNetwork();
   
   /** Initialise weights of a ``FannNetwork`` using descriptor configuration. */
   void IntializeWeights(FannNetwork& ann, FannTrainData& train_data);
   
+  /**
+    Keep the weights of the networks trained with the descriptor on each fold
+    of a fold plan (indexed by repeat and then fold, and empty for folds that
+    were not trained) so networks it creates for the same fold (and networks
+    of descriptors bred from it with the same layers) can start from them.
+    Trained weights are not part of the configuration, so they are ignored by
+    comparisons and not serialized.
+  */
+  void SetTrainedWeights(std::vector<std::vector<fann_type>> fold_weights);
+  
+  /**
+    Initialise weights of a ``FannNetwork`` with the trained weights kept for
+    a fold of the plan and reset its training state. Returns false, leaving
+    the network untouched, when no weights were kept for the fold and the
+    descriptor's layers.
+  */
+  bool WarmStartWeights(FannNetwork& ann, unsigned fold) const;
+  
+  /** Whether trained weights were kept for the descriptor's layers. */
+  bool HasTrainedWeights() const;
+  
   /** Reset descriptor to default configuration. */
   void Reset();
   
@@ -53,7 +82,32 @@ class FannNetworkDescriptor {
   /** Print the descriptor configuration. */
   void PrintDescription();
   
+  /**
+    Hash of the descriptor configuration consistent with ``operator==``.
+  */
+  std::size_t Hash() const;
+  
+  /**
+    Compare descriptors. Descriptors are equal when they create identically
+    configured networks that are initialised and trained the same way, so
+    hyperparameters unused by the training algorithm or weight initialisation
+    are ignored.
+  */
+  bool operator==(const FannNetworkDescriptor &descriptor) const;
+  bool operator!=(const FannNetworkDescriptor &descriptor) const;
+  
+  /** Write the descriptor configuration in a binary form. */
+  void Serialize(std::ostream &stream) const;
+  
+  /**
+    Read a descriptor configuration written by ``Serialize``. Returns false if
+    the stream ends early or holds an invalid configuration.
+  */
+  bool Deserialize(std::istream &stream);
+  
  private:
+  std::vector<float> EffectiveHyperparameters() const;
+  
   unsigned num_input_;
   unsigned num_output_;
   
@@ -82,7 +136,45 @@ class FannNetworkDescriptor {
   bool wn_weight_init_;
   float min_weight_;
   float max_weight_;
+  
+  // Shared by the copies made when breeding, with the layers they fit
+  std::shared_ptr<const std::vector<std::vector<fann_type>>> trained_weights_;
+  std::vector<unsigned> trained_layers_;
 };
 
+/**
+  \rst
+  Get a network with the given layer sizes, reusing a network released by the
+  calling thread when one of the same topology is available. Networks are
+  returned to the pool of the thread that destroys them. Training state is
+  reset as by ``fann_reset_train_arrays``, but every setting (activation
+  functions, training parameters and weights) may be left over from a
+  previous use and must be configured by the caller, as
+  ``FannNetworkDescriptor::CreateNetwork`` and ``IntializeWeights`` do.
+  Callers changing the training algorithm reset the training state again.
+  
+  ***Example**::
+  
+    FannNetwork network = AcquirePooledNetwork({4, 8, 1});
+    fann_randomize_weights(network.get(), -0.1f, 0.1f);
+  \endrst
+*/
+FannNetwork AcquirePooledNetwork(const std::vector<unsigned> &layers);
+
+/**
+  State of the random number generator used by descriptors on the calling
+  thread, so breeding can be resumed from a checkpoint.
+*/
+std::string GetDescriptorRngState();
+
+/** Restore a state returned by ``GetDescriptorRngState``. */
+void SetDescriptorRngState(const std::string &state);
+
+/** Hash functor to key unordered containers by ``FannNetworkDescriptor``. */
+struct FannNetworkDescriptorHash {
+  std::size_t operator()(const FannNetworkDescriptor &descriptor) const {
+    return descriptor.Hash();
+  }
+};
 
 #endif // NETWORK_H_
@@ -0,0 +1,122 @@
+/*
+  profile.cc
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "profile.h"
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef PROFILE
+
+static const char *kPhaseNames[] = {
+  "fold_construction", "train_epoch", "validation", "snapshot",
+  "create_network", "initialize_weights", "breeding", "write_csv"
+};
+static const char *kCounterNames[] = {
+  "train_samples", "validation_samples", "fold_samples", "csv_rows"
+};
+static_assert(sizeof(kPhaseNames) / sizeof(*kPhaseNames) ==
+              static_cast<int>(ProfilePhase::kCount), "Missing phase name");
+static_assert(sizeof(kCounterNames) / sizeof(*kCounterNames) ==
+              static_cast<int>(ProfileCounter::kCount), "Missing counter name");
+
+// Totals of every thread, kept after the threads exit
+static std::mutex registry_mutex;
+static std::vector<std::shared_ptr<ProfileTotals>> registry;
+
+ProfileTotals& ThreadProfileTotals() {
+  thread_local static std::shared_ptr<ProfileTotals> totals = []() {
+    auto thread_totals = std::make_shared<ProfileTotals>();
+    for (auto &calls : thread_totals->calls) calls = 0;
+    for (auto &nanoseconds : thread_totals->nanoseconds) nanoseconds = 0;
+    for (auto &counter : thread_totals->counters) counter = 0;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.push_back(thread_totals);
+    return thread_totals;
+  }();
+  return *totals;
+}
+
+bool WriteProfile(const std::string &path) {
+  const int num_phases = static_cast<int>(ProfilePhase::kCount);
+  const int num_counters = static_cast<int>(ProfileCounter::kCount);
+  struct Snapshot {
+    std::uint64_t calls[static_cast<int>(ProfilePhase::kCount)];
+    std::uint64_t nanoseconds[static_cast<int>(ProfilePhase::kCount)];
+    std::uint64_t counters[static_cast<int>(ProfileCounter::kCount)];
+  };
+  
+  // Copy the totals of each thread and sum them
+  std::vector<Snapshot> threads;
+  Snapshot total = {};
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto &totals : registry) {
+      Snapshot thread;
+      for (int phase = 0; phase < num_phases; ++phase) {
+        thread.calls[phase] = totals->calls[phase].load();
+        thread.nanoseconds[phase] = totals->nanoseconds[phase].load();
+        total.calls[phase] += thread.calls[phase];
+        total.nanoseconds[phase] += thread.nanoseconds[phase];
+      }
+      for (int counter = 0; counter < num_counters; ++counter) {
+        thread.counters[counter] = totals->counters[counter].load();
+        total.counters[counter] += thread.counters[counter];
+      }
+      threads.push_back(thread);
+    }
+  }
+  
+  std::ofstream json(path, std::ofstream::out|std::ofstream::trunc);
+  auto write_snapshot = [&](const Snapshot &snapshot) {
+    json << "{\"phases\": {";
+    for (int phase = 0; phase < num_phases; ++phase) {
+      json << (phase ? ", " : "") << "\"" << kPhaseNames[phase]
+           << "\": {\"calls\": " << snapshot.calls[phase]
+           << ", \"seconds\": " << (snapshot.nanoseconds[phase] / 1e9) << "}";
+    }
+    json << "}, \"counters\": {";
+    for (int counter = 0; counter < num_counters; ++counter) {
+      json << (counter ? ", " : "") << "\"" << kCounterNames[counter]
+           << "\": " << snapshot.counters[counter];
+    }
+    json << "}}";
+  };
+  json << "{\"total\": ";
+  write_snapshot(total);
+  json << ",\n \"threads\": [";
+  for (unsigned thread = 0; thread < threads.size(); ++thread) {
+    json << (thread ? ",\n  " : "\n  ");
+    write_snapshot(threads[thread]);
+  }
+  json << "]}" << std::endl;
+  
+  return static_cast<bool>(json);
+}
+
+#else
+
+bool WriteProfile(const std::string &path) {
+  return false;
+}
+
+#endif // PROFILE
@@ -0,0 +1,156 @@
+/*
+  profile.h
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/** Phases of the pipeline timed by ``PROFILE_SCOPE``. */
+enum class ProfilePhase {
+  kFoldConstruction,  // Building folds in CrossValidation
+  kTrainEpoch,  // fann_train_epoch in TrainNetwork
+  kValidation,  // Validation error in TrainNetwork
+  kSnapshot,  // Saving and restoring the best weights in TrainNetwork
+  kCreateNetwork,  // FannNetworkDescriptor::CreateNetwork
+  kInitializeWeights,  // FannNetworkDescriptor::IntializeWeights
+  kBreeding,  // Crossover and mutation in EvolutionaryOptimize
+  kWriteCsv,  // WriteCsv
+  kCount
+};
+
+/** Quantities counted by ``PROFILE_COUNT``. */
+enum class ProfileCounter {
+  kTrainSamples,  // Samples presented to fann_train_epoch
+  kValidationSamples,  // Samples evaluated for validation errors
+  kFoldSamples,  // Samples placed into folds and training sets
+  kCsvRows,  // Rows written by WriteCsv
+  kCount
+};
+
+#ifdef PROFILE
+
+/**
+  Totals accumulated by a single thread. Only the owning thread writes them,
+  so updates are plain loads and stores that other threads can read safely
+  while a profile is written.
+*/
+struct ProfileTotals {
+  std::atomic<std::uint64_t> calls[static_cast<int>(ProfilePhase::kCount)];
+  std::atomic<std::uint64_t> nanoseconds[
+      static_cast<int>(ProfilePhase::kCount)];
+  std::atomic<std::uint64_t> counters[
+      static_cast<int>(ProfileCounter::kCount)];
+};
+
+/** Totals of the calling thread (registered on first use). */
+ProfileTotals& ThreadProfileTotals();
+
+/** Adds the time spent in a scope to the totals of its phase. */
+class ProfileTimer {
+ public:
+  explicit ProfileTimer(ProfilePhase phase)
+      : phase_(static_cast<int>(phase)),
+        start_(std::chrono::steady_clock::now()) {}
+  
+  ~ProfileTimer() {
+    Stop();
+  }
+  
+  ProfileTimer(const ProfileTimer&) = delete;
+  ProfileTimer& operator=(const ProfileTimer&) = delete;
+  
+  /** Add the time since construction to the phase (only the first call). */
+  void Stop() {
+    if (phase_ < 0) {
+      return;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_);
+    ProfileTotals &totals = ThreadProfileTotals();
+    Add(totals.calls[phase_], 1);
+    Add(totals.nanoseconds[phase_],
+        static_cast<std::uint64_t>(elapsed.count()));
+    phase_ = -1;
+  }
+  
+  /** Increment a total owned by the calling thread. */
+  static void Add(std::atomic<std::uint64_t> &total, std::uint64_t amount) {
+    total.store(total.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+  }
+  
+ private:
+  int phase_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#define PROFILE_CONCATENATE_(left, right) left##right
+#define PROFILE_CONCATENATE(left, right) PROFILE_CONCATENATE_(left, right)
+
+/** Time the rest of the enclosing scope as a ``ProfilePhase``. */
+#define PROFILE_SCOPE(phase) \
+    ProfileTimer PROFILE_CONCATENATE(profile_timer_, __LINE__)(phase)
+
+/** Time a phase from here until ``PROFILE_STOP(name)`` or the scope ends. */
+#define PROFILE_TIMER(name, phase) ProfileTimer name(phase)
+
+/** Stop a timer started by ``PROFILE_TIMER``. */
+#define PROFILE_STOP(name) name.Stop()
+
+/** Add an amount to a ``ProfileCounter`` of the calling thread. */
+#define PROFILE_COUNT(counter, amount) \
+    ProfileTimer::Add(ThreadProfileTotals().counters[ \
+        static_cast<int>(counter)], static_cast<std::uint64_t>(amount))
+
+#else
+
+#define PROFILE_SCOPE(phase) do {} while (0)
+#define PROFILE_TIMER(name, phase) do {} while (0)
+#define PROFILE_STOP(name) do {} while (0)
+#define PROFILE_COUNT(counter, amount) do {} while (0)
+
+#endif // PROFILE
+
+/**
+  \rst
+  Write the totals of every thread that recorded a phase or counter as JSON,
+  along with the totals over all threads. Does nothing unless the project is
+  built with ``-DPROFILE``, in which case ``PROFILE_SCOPE`` and
+  ``PROFILE_COUNT`` accumulate into thread-local totals (they compile to
+  nothing otherwise).
+  
+  ***Example**::
+  
+    void TrainStep() {
+      PROFILE_SCOPE(ProfilePhase::kTrainEpoch);
+      PROFILE_COUNT(ProfileCounter::kTrainSamples, num_samples);
+      ...
+    }
+    
+    WriteProfile("models/profile.json");
+  \endrst
+*/
+bool WriteProfile(const std::string &path);
+
+#endif // PROFILE_H_
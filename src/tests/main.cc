@@ -20,21 +20,40 @@
 
 #include <fann.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <iterator>
 #include <memory>
+#include <set>
 #include <string>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 
 #define CATCH_CONFIG_MAIN
 #include <catch2/catch.hpp>
 
+#include "./../batcher.h"
+#include "./../checkpoint.h"
+#include "./../config.h"
 #include "./../crossvalidate.h"
 #include "./../data.h"
+#include "./../ensemble.h"
 #include "./../fann_types.h"
 #include "./../fann_extension.h"
+#include "./../inference.h"
+#include "./../network.h"
+#include "./../profile.h"
+#include "./../threadpool.h"
+#include "./../train.h"
+#include "./../trainer.h"
 
 FannTrainData GenerateData(int samples) {
   auto data = FannTrainData(fann_create_train(samples, 2, 1));
@@ -59,8 +78,42 @@ TEST_CASE("LoadTrainData", "[Data]") {
   test_file.close();
   std::shared_ptr<void> _(nullptr, [](...){ remove(test_path); });
   
-  FannTrainData data = LoadTrainData({test_path, test_path});
+  std::vector<TrainDataFileStats> file_stats;
+  FannTrainData data = LoadTrainData({test_path, test_path}, &file_stats);
   REQUIRE(fann_length_train_data(data.get()) == 4);
+  REQUIRE(file_stats.size() == 2);
+  REQUIRE(file_stats[1].num_samples == 2);
+  
+  FannTrainData expected(fann_read_train_from_file(test_path));
+  std::vector<std::vector<float>> values = GetTrainDataValues(data);
+  std::vector<std::vector<float>> expected_values = GetTrainDataValues(
+      expected);
+  REQUIRE(values[2] == expected_values[0]);
+  REQUIRE(values[3] == expected_values[1]);
+  
+  static const char *mismatched_path = "test-mismatched.dat";
+  std::ofstream mismatched_file(mismatched_path);
+  mismatched_file << "1 1 1\n0\n1\n";
+  mismatched_file.close();
+  std::shared_ptr<void> __(nullptr, [](...){ remove(mismatched_path); });
+  REQUIRE(!LoadTrainData({test_path, mismatched_path}));
+}
+
+TEST_CASE("WriteBinaryTrainData", "[Data]") {
+  static const char *binary_path = "test.bin";
+  FannTrainData data = GenerateData(10);
+  REQUIRE(WriteBinaryTrainData(binary_path, data));
+  std::shared_ptr<void> _(nullptr, [](...){ remove(binary_path); });
+  
+  FannTrainData binary_data = LoadTrainData({binary_path});
+  REQUIRE(binary_data);
+  REQUIRE(binary_data.get_deleter().view);
+  REQUIRE(GetTrainDataValues(binary_data) == GetTrainDataValues(data));
+  
+  FannTrainData merged_data = LoadTrainData({binary_path, binary_path});
+  REQUIRE(fann_length_train_data(merged_data.get()) == 20);
+  REQUIRE(GetTrainDataValues(merged_data)[15] ==
+          GetTrainDataValues(data)[5]);
 }
 
 TEST_CASE("StratifyTrainData", "[Data]") {
@@ -123,4 +176,840 @@ TEST_CASE("CrossValidation", "[crossvalidate]") {
   }, 10, 2);
 }
 
+TEST_CASE("CrossValidation seed", "[crossvalidate]") {
+  auto data = std::vector<FannTrainData>();
+  data.emplace_back(FannTrainData(fann_create_train(50, 1, 1)));
+  for (unsigned sample = 0; sample < 50; ++sample) {
+    data[0]->input[sample][0] = static_cast<float>(sample);
+  }
+  
+  auto validation_samples = [&](CVFoldMode mode, unsigned seed) {
+    std::vector<float> samples;
+    CrossValidation(data, [&](FannTrainData &train, FannTrainData &test) {
+      for (unsigned sample = 0; sample < test->num_data; ++sample) {
+        samples.push_back(test->input[sample][0]);
+      }
+    }, 5, 2, mode, seed);
+    return samples;
+  };
+  
+  std::vector<float> samples = validation_samples(CVFoldMode::kView, 7);
+  REQUIRE(samples.size() == 100);
+  REQUIRE(validation_samples(CVFoldMode::kView, 7) == samples);
+  REQUIRE(validation_samples(CVFoldMode::kCopy, 7) == samples);
+  REQUIRE(validation_samples(CVFoldMode::kView, 8) != samples);
+}
+
+
+
+TEST_CASE("CrossValidation fold views", "[crossvalidate]") {
+  auto data = std::vector<FannTrainData>();
+  data.emplace_back(GenerateData(60));
+  data.emplace_back(GenerateData(40));
+  float *first_row = data[0]->input[0];
+  std::vector<float> original = GetTrainDataValues(data[0])[0];
+  
+  CrossValidation(data,
+                  [&](FannTrainData &train, FannTrainData &test,
+                      int fold, int repeat) {
+    REQUIRE(fann_length_train_data(train.get()) == 90);
+    REQUIRE(fann_length_train_data(test.get()) == 10);
+    
+    // Every sample is referenced exactly once across both sets
+    std::vector<float*> rows(train->input, train->input + train->num_data);
+    rows.insert(rows.end(), test->input, test->input + test->num_data);
+    std::sort(rows.begin(), rows.end());
+    REQUIRE(std::unique(rows.begin(), rows.end()) == rows.end());
+    for (float *row : rows) {
+      bool in_strata = false;
+      for (auto &stratum : data) {
+        in_strata |= std::find(stratum->input,
+                               stratum->input + stratum->num_data,
+                               row) != stratum->input + stratum->num_data;
+      }
+      REQUIRE(in_strata);
+    }
+  }, 10, 2, CVFoldMode::kView);
+  
+  // Strata are left untouched
+  REQUIRE(data[0]->input[0] == first_row);
+  REQUIRE(GetTrainDataValues(data[0])[0] == original);
+}
+
+TEST_CASE("CrossValidation concurrent views", "[crossvalidate]") {
+  auto data = std::vector<FannTrainData>();
+  data.emplace_back(GenerateData(60));
+  data.emplace_back(GenerateData(40));
+  std::vector<float*> first_stratum_rows(data[0]->input,
+                                         data[0]->input + 60);
+  std::vector<float*> strata_rows(first_stratum_rows);
+  strata_rows.insert(strata_rows.end(), data[1]->input, data[1]->input + 40);
+  std::sort(strata_rows.begin(), strata_rows.end());
+  
+  // Tasks share the strata and record the rows of every validation fold
+  ThreadPool pool(4);
+  TaskGroup tasks(pool);
+  std::vector<std::vector<float*>> validation_rows(8);
+  for (auto &rows : validation_rows) {
+    tasks.Run([&]() {
+      CrossValidation(data, [&](FannTrainData &train, FannTrainData &test) {
+        rows.insert(rows.end(), test->input, test->input + test->num_data);
+      }, 10, 5, CVFoldMode::kView);
+    });
+  }
+  tasks.Wait();
+  
+  // Each repeat of each task validates on every sample exactly once
+  for (auto &rows : validation_rows) {
+    REQUIRE(rows.size() == 500);
+    for (unsigned repeat = 0; repeat < 5; ++repeat) {
+      std::vector<float*> repeat_rows(rows.begin() + repeat * 100,
+                                      rows.begin() + (repeat + 1) * 100);
+      std::sort(repeat_rows.begin(), repeat_rows.end());
+      REQUIRE(repeat_rows == strata_rows);
+    }
+  }
+  
+  // Strata keep their order
+  REQUIRE(std::vector<float*>(data[0]->input, data[0]->input + 60) ==
+          first_stratum_rows);
+}
 
+TEST_CASE("FoldPlan", "[crossvalidate]") {
+  auto data = std::vector<FannTrainData>();
+  data.emplace_back(GenerateData(57));
+  data.emplace_back(GenerateData(43));
+  std::vector<float*> strata_rows(data[0]->input, data[0]->input + 57);
+  strata_rows.insert(strata_rows.end(), data[1]->input, data[1]->input + 43);
+  std::sort(strata_rows.begin(), strata_rows.end());
+  std::vector<std::pair<float*, float*>> strata_samples;
+  for (auto &stratum : data) {
+    for (unsigned sample = 0; sample < stratum->num_data; ++sample) {
+      strata_samples.emplace_back(stratum->input[sample],
+                                  stratum->output[sample]);
+    }
+  }
+  std::sort(strata_samples.begin(), strata_samples.end());
+  
+  // Validation folds match cross validation with the same seed
+  FoldPlan plan(data, 10, 3, 11);
+  REQUIRE(plan.Folds() == 10);
+  REQUIRE(plan.Repeats() == 3);
+  CrossValidation(data, [&](FannTrainData &train, FannTrainData &test,
+                            int fold, int repeat) {
+    FannTrainData &validation = plan.Validation(repeat)[fold];
+    REQUIRE(validation->num_data == test->num_data);
+    REQUIRE(std::equal(test->input, test->input + test->num_data,
+                       validation->input));
+    REQUIRE(std::equal(test->output, test->output + test->num_data,
+                       validation->output));
+  }, 10, 3, CVFoldMode::kView, 11);
+  
+  // Training sets hold every sample outside their validation fold, keeping
+  // inputs paired with their outputs
+  for (int repeat = 0; repeat < plan.Repeats(); ++repeat) {
+    for (int fold = 0; fold < plan.Folds(); ++fold) {
+      FannTrainData &train = plan.Training(repeat)[fold];
+      FannTrainData &validation = plan.Validation(repeat)[fold];
+      std::vector<float*> rows(train->input, train->input + train->num_data);
+      rows.insert(rows.end(), validation->input,
+                  validation->input + validation->num_data);
+      std::sort(rows.begin(), rows.end());
+      REQUIRE(rows == strata_rows);
+      for (unsigned sample = 0; sample < train->num_data; ++sample) {
+        REQUIRE(std::binary_search(strata_samples.begin(),
+                                   strata_samples.end(),
+                                   std::make_pair(train->input[sample],
+                                                  train->output[sample])));
+      }
+    }
+  }
+}
+
+TEST_CASE("ParallelCrossValidation", "[crossvalidate]") {
+  auto data = std::vector<FannTrainData>();
+  data.emplace_back(GenerateData(60));
+  data.emplace_back(GenerateData(40));
+  
+  // Results are consumed in order of repeat and fold whatever order tasks
+  // finish in
+  std::vector<std::pair<unsigned, std::vector<float*>>> results;
+  std::vector<std::pair<int, int>> consumed;
+  ParallelCrossValidation(data,
+      [](FannTrainData &train, FannTrainData &test, int fold, int repeat) {
+    return std::make_pair(
+        train->num_data,
+        std::vector<float*>(test->input, test->input + test->num_data));
+  }, [&](std::pair<unsigned, std::vector<float*>> result,
+         int fold, int repeat) {
+    results.push_back(std::move(result));
+    consumed.emplace_back(repeat, fold);
+  }, 10, 3, 5);
+  REQUIRE(results.size() == 30);
+  REQUIRE(std::is_sorted(consumed.begin(), consumed.end()));
+  FoldPlan plan(data, 10, 3, 5);
+  for (int repeat = 0; repeat < 3; ++repeat) {
+    for (int fold = 0; fold < 10; ++fold) {
+      FannTrainData &test = plan.Validation(repeat)[fold];
+      REQUIRE(results[repeat * 10 + fold].first == 90);
+      REQUIRE(results[repeat * 10 + fold].second ==
+              std::vector<float*>(test->input, test->input + test->num_data));
+    }
+  }
+}
+
+TEST_CASE("WriteProfile", "[profile]") {
+  static const char *profile_path = "test-profile.json";
+  std::shared_ptr<void> _(nullptr, [](...){ remove(profile_path); });
+  {
+    PROFILE_SCOPE(ProfilePhase::kWriteCsv);
+    PROFILE_COUNT(ProfileCounter::kCsvRows, 3);
+  }
+#ifdef PROFILE
+  REQUIRE(WriteProfile(profile_path));
+  std::ifstream json(profile_path);
+  std::string text((std::istreambuf_iterator<char>(json)),
+                   std::istreambuf_iterator<char>());
+  REQUIRE(text.find("\"write_csv\": {\"calls\": ") != std::string::npos);
+  REQUIRE(text.find("\"threads\": [") != std::string::npos);
+#else
+  REQUIRE(!WriteProfile(profile_path));
+#endif
+}
+
+TEST_CASE("TaskGroup", "[threadpool]") {
+  ThreadPool pool(4);
+  std::atomic<int> count(0);
+  
+  // Nested groups wait without exhausting the threads of the pool
+  TaskGroup outer(pool);
+  for (int task = 0; task < 16; ++task) {
+    outer.Run([&]() {
+      TaskGroup inner(pool);
+      for (int subtask = 0; subtask < 16; ++subtask) {
+        inner.Run([&]() { ++count; });
+      }
+      inner.Wait();
+    });
+  }
+  outer.Wait();
+  REQUIRE(count == 256);
+  
+  TaskGroup failing(pool);
+  failing.Run([]() { throw std::runtime_error("task failed"); });
+  REQUIRE_THROWS_AS(failing.Wait(), std::runtime_error);
+}
+
+TEST_CASE("FannNetworkDescriptor equality", "[network]") {
+  FannNetworkDescriptor descriptor(4, 1);
+  FannNetworkDescriptor copy = descriptor;
+  REQUIRE(copy == descriptor);
+  REQUIRE(copy.Hash() == descriptor.Hash());
+  
+  copy.Mutate(1.0f, 0.5f, 1.0f);
+  REQUIRE(copy != descriptor);
+  
+  descriptor = copy;
+  REQUIRE(copy == descriptor);
+  REQUIRE(FannNetworkDescriptorHash()(copy) == descriptor.Hash());
+}
+
+TEST_CASE("FannNetworkDescriptor serialization", "[network]") {
+  FannNetworkDescriptor descriptor(4, 1);
+  descriptor.Mutate(1.0f, 0.5f, 1.0f);
+  std::ostringstream stream;
+  descriptor.Serialize(stream);
+  const std::string serialized = stream.str();
+  
+  FannNetworkDescriptor loaded(4, 1);
+  std::istringstream loaded_stream(serialized);
+  REQUIRE(loaded.Deserialize(loaded_stream));
+  REQUIRE(loaded == descriptor);
+  std::istringstream truncated_stream(serialized.substr(0, 30));
+  REQUIRE(!loaded.Deserialize(truncated_stream));
+  
+  // Replace the 32-bit field at an offset and deserialize the result
+  auto deserialize_with = [&](std::size_t offset, std::uint32_t value) {
+    std::string corrupt = serialized;
+    std::memcpy(&corrupt[offset], &value, sizeof(value));
+    std::istringstream corrupt_stream(corrupt);
+    return FannNetworkDescriptor(4, 1).Deserialize(corrupt_stream);
+  };
+  
+  // Inputs, outputs, momentum and learning rate precede the training
+  // algorithm, then the layer sizes and activation functions
+  std::uint32_t num_layers;
+  std::memcpy(&num_layers, &serialized[20], sizeof(num_layers));
+  const std::size_t first_layer = 24;
+  const std::size_t first_activation = first_layer + 4 * num_layers + 4;
+  REQUIRE(deserialize_with(16, FANN_TRAIN_SARPROP));
+  REQUIRE(!deserialize_with(16, FANN_TRAIN_SARPROP + 1));
+  REQUIRE(!deserialize_with(first_layer, 5));
+  REQUIRE(!deserialize_with(first_layer + 4 * (num_layers - 1), 2));
+  REQUIRE(!deserialize_with(first_layer + 4, 0));
+  REQUIRE(!deserialize_with(first_activation - 4, num_layers));
+  REQUIRE(deserialize_with(first_activation, FANN_COS));
+  REQUIRE(!deserialize_with(first_activation, FANN_COS + 1));
+}
+
+TEST_CASE("FannNetworkDescriptor trained weights", "[network]") {
+  FannNetworkDescriptor descriptor(4, 1);
+  FannNetwork network = descriptor.CreateNetwork();
+  REQUIRE_FALSE(descriptor.HasTrainedWeights());
+  REQUIRE_FALSE(descriptor.WarmStartWeights(network, 0));
+  
+  // Trained weights are shared by copies without changing the configuration
+  // and only start networks for the folds they were trained on
+  fann_randomize_weights(network.get(), -1.0f, 1.0f);
+  FannNetworkDescriptor child = descriptor;
+  child.SetTrainedWeights({
+    std::vector<fann_type>(),
+    std::vector<fann_type>(network->weights,
+                           network->weights + network->total_connections)
+  });
+  REQUIRE(child == descriptor);
+  REQUIRE(child.Hash() == descriptor.Hash());
+  FannNetworkDescriptor grandchild = child;
+  FannNetwork warm_network = grandchild.CreateNetwork();
+  fann_randomize_weights(warm_network.get(), -1.0f, 1.0f);
+  REQUIRE_FALSE(grandchild.WarmStartWeights(warm_network, 0));
+  REQUIRE_FALSE(grandchild.WarmStartWeights(warm_network, 2));
+  REQUIRE(grandchild.WarmStartWeights(warm_network, 1));
+  REQUIRE(std::equal(network->weights,
+                     network->weights + network->total_connections,
+                     warm_network->weights));
+  
+  // Warm starts discard the training state of the network, so it trains as a
+  // new network from the same weights would
+  auto data = FannTrainData(fann_create_train(20, 4, 1));
+  for (unsigned sample = 0; sample < 20; ++sample) {
+    for (unsigned input = 0; input < 4; ++input) {
+      data->input[sample][input] = 0.05f * sample - 0.1f * input;
+    }
+    data->output[sample][0] = sample < 10 ? 0.0f : 1.0f;
+  }
+  fann_train_epoch(warm_network.get(), data.get());
+  fann_train_epoch(warm_network.get(), data.get());
+  REQUIRE(grandchild.WarmStartWeights(warm_network, 1));
+  FannNetwork cold_network = grandchild.CreateNetwork();
+  std::copy_n(network->weights, network->total_connections,
+              cold_network->weights);
+  for (int epoch = 0; epoch < 2; ++epoch) {
+    fann_train_epoch(warm_network.get(), data.get());
+    fann_train_epoch(cold_network.get(), data.get());
+  }
+  REQUIRE(std::equal(cold_network->weights,
+                     cold_network->weights + cold_network->total_connections,
+                     warm_network->weights));
+  
+  // Weights no longer fit once the layers change
+  FannNetworkDescriptor wider(4, 2);
+  wider.Merge(child);
+  REQUIRE_FALSE(wider.HasTrainedWeights());
+  grandchild.Reset();
+  REQUIRE_FALSE(grandchild.HasTrainedWeights());
+}
+
+TEST_CASE("AcquirePooledNetwork", "[network]") {
+  
+  // Released networks are reused for the same topology only
+  fann *released = nullptr;
+  {
+    FannNetwork network = AcquirePooledNetwork({3, 4, 1});
+    released = network.get();
+  }
+  FannNetwork reused = AcquirePooledNetwork({3, 4, 1});
+  REQUIRE(reused.get() == released);
+  FannNetwork other = AcquirePooledNetwork({3, 5, 1});
+  REQUIRE(other.get() != released);
+  REQUIRE(fann_get_total_connections(other.get()) == 4 * 5 + 6 * 1);
+  
+  // Descriptors reconfigure every setting of a reused network
+  FannNetworkDescriptor descriptor(3, 1);
+  descriptor.Mutate(1.0f, 0.5f, 1.0f);
+  FannNetwork network = descriptor.CreateNetwork();
+  fann_train_enum algorithm = fann_get_training_algorithm(network.get());
+  float learning_rate = fann_get_learning_rate(network.get());
+  fann_activationfunc_enum activation = fann_get_activation_function(
+      network.get(), 1, 0);
+  fann_type steepness = fann_get_activation_steepness(network.get(), 1, 0);
+  fann_set_training_algorithm(network.get(), algorithm == FANN_TRAIN_BATCH
+      ? FANN_TRAIN_QUICKPROP : FANN_TRAIN_BATCH);
+  fann_set_learning_rate(network.get(), learning_rate + 1.0f);
+  fann_set_activation_function_layer(network.get(), activation == FANN_LINEAR
+      ? FANN_GAUSSIAN : FANN_LINEAR, 1);
+  fann_set_activation_steepness_layer(network.get(), steepness + 1.0f, 1);
+  released = network.get();
+  network.reset();
+  network = descriptor.CreateNetwork();
+  REQUIRE(network.get() == released);
+  REQUIRE(fann_get_training_algorithm(network.get()) == algorithm);
+  REQUIRE(fann_get_learning_rate(network.get()) == learning_rate);
+  REQUIRE(fann_get_activation_function(network.get(), 1, 0) == activation);
+  REQUIRE(fann_get_activation_steepness(network.get(), 1, 0) == steepness);
+  
+  // A reused network trains exactly as a new one from the same weights, so
+  // no training state (steps, slopes, momentum or SARPROP epoch) carries over
+  FannTrainData data = GenerateData(40);
+  std::set<fann_train_enum> algorithms;
+  for (int attempt = 0; attempt < 1000 && algorithms.size() < 5; ++attempt) {
+    FannNetworkDescriptor trained_descriptor(2, 1);
+    trained_descriptor.Mutate(1.0f, 0.5f, 1.0f);
+    FannNetwork trained = trained_descriptor.CreateNetwork();
+    if (!algorithms.insert(fann_get_training_algorithm(trained.get())).second) {
+      continue;
+    }
+    trained_descriptor.IntializeWeights(trained, data);
+    fann_train_epoch(trained.get(), data.get());
+    fann_train_epoch(trained.get(), data.get());
+    released = trained.get();
+    trained.reset();
+    
+    FannNetwork reused = trained_descriptor.CreateNetwork();
+    FannNetwork fresh = trained_descriptor.CreateNetwork();
+    REQUIRE(reused.get() == released);
+    REQUIRE(fresh.get() != released);
+    fann_randomize_weights(fresh.get(), -0.5f, 0.5f);
+    std::copy_n(fresh->weights, fresh->total_connections, reused->weights);
+    for (int epoch = 0; epoch < 2; ++epoch) {
+      fann_train_epoch(reused.get(), data.get());
+      fann_train_epoch(fresh.get(), data.get());
+    }
+    REQUIRE(std::equal(fresh->weights,
+                       fresh->weights + fresh->total_connections,
+                       reused->weights));
+  }
+  REQUIRE(algorithms.size() == 5);
+}
+
+TEST_CASE("CompiledNetwork", "[inference]") {
+  const fann_activationfunc_enum activation_functions[] = {
+    FANN_SIGMOID, FANN_SIGMOID_SYMMETRIC, FANN_SIGMOID_STEPWISE,
+    FANN_GAUSSIAN, FANN_ELLIOT_SYMMETRIC, FANN_LINEAR_PIECE_SYMMETRIC,
+    FANN_SIN, FANN_COS_SYMMETRIC, FANN_LINEAR,
+  };
+  auto data = FannTrainData(fann_create_train(21, 6, 2));
+  for (unsigned sample = 0; sample < 21; ++sample) {
+    for (unsigned input = 0; input < 6; ++input) {
+      data->input[sample][input] = 0.1f * sample - 0.3f * input;
+    }
+    data->output[sample][0] = sample % 2 ? 0.9f : -0.4f;
+    data->output[sample][1] = 0.05f * sample;
+  }
+  
+  for (auto activation_function : activation_functions) {
+    FannNetwork network(fann_create_standard(4, 6, 7, 4, 2));
+    fann_randomize_weights(network.get(), -1.0f, 1.0f);
+    fann_set_activation_function_hidden(network.get(), activation_function);
+    fann_set_activation_function_output(network.get(), FANN_SIGMOID);
+    fann_set_activation_steepness_hidden(network.get(), 0.7f);
+    
+    CompiledNetwork compiled(network);
+    REQUIRE(compiled.NumInput() == 6);
+    REQUIRE(compiled.NumOutput() == 2);
+    std::vector<fann_type> outputs(21 * compiled.NumOutput());
+    compiled.Run(data->input, 21, outputs.data());
+    for (unsigned sample = 0; sample < 21; ++sample) {
+      fann_type *expected = fann_run(network.get(), data->input[sample]);
+      REQUIRE(outputs[sample * 2] == Approx(expected[0]).margin(1e-6));
+      REQUIRE(outputs[sample * 2 + 1] == Approx(expected[1]).margin(1e-6));
+    }
+    
+    fann_set_activation_function_output(network.get(), activation_function);
+    compiled = CompiledNetwork(network);
+    REQUIRE(compiled.MeanSquaredError(data) ==
+            Approx(fann_test_data(network.get(), data.get())).margin(1e-6));
+  }
+}
+
+TEST_CASE("TrainNetwork", "[train]") {
+  auto data = FannTrainData(fann_create_train(200, 2, 1));
+  for (unsigned sample = 0; sample < 200; ++sample) {
+    data->input[sample][0] = 0.01f * sample - 1.0f;
+    data->input[sample][1] = 0.013f * (sample % 50);
+    data->output[sample][0] = data->input[sample][0] > 0.3f ? 1.0f : 0.0f;
+  }
+  auto training_data = FannTrainData(fann_subset_train_data(data.get(), 0,
+                                                            150));
+  auto validation_data = FannTrainData(fann_subset_train_data(data.get(), 150,
+                                                              50));
+  
+  // The weights with the lowest validation error are restored after training
+  for (int run = 0; run < 3; ++run) {
+    FannNetwork network(fann_create_standard(3, 2, 3 + run, 1));
+    fann_set_training_algorithm(network.get(), FANN_TRAIN_RPROP);
+    fann_randomize_weights(network.get(), -0.5f, 0.5f);
+    float error = TrainNetwork(network, training_data, validation_data);
+    REQUIRE(fann_test_data(network.get(), validation_data.get()) ==
+            Approx(error).epsilon(1e-5));
+  }
+}
+
+TEST_CASE("TrainNetwork nested in parallel epochs", "[train]") {
+  const unsigned num_data = 2 * kTrainParallelSamples + 5;
+  auto large_data = FannTrainData(fann_create_train(num_data, 2, 1));
+  for (unsigned sample = 0; sample < num_data; ++sample) {
+    large_data->input[sample][0] = 2.0f * sample / num_data - 1.0f;
+    large_data->input[sample][1] = 0.013f * (sample % 50);
+    large_data->output[sample][0] =
+        large_data->input[sample][0] > 0.3f ? 1.0f : 0.0f;
+  }
+  auto small_data = FannTrainData(fann_subset_train_data(large_data.get(), 0,
+                                                         200));
+  
+  FannNetwork large_network(fann_create_standard(3, 2, 8, 1));
+  FannNetwork small_network(fann_create_standard(3, 2, 2, 1));
+  for (FannNetwork *network : {&large_network, &small_network}) {
+    fann_set_training_algorithm(network->get(), FANN_TRAIN_RPROP);
+    fann_randomize_weights(network->get(), -0.5f, 0.5f);
+  }
+  FannNetwork large_expected(fann_copy(large_network.get()));
+  FannNetwork small_expected(fann_copy(small_network.get()));
+  TrainNetwork(large_expected, large_data, small_data);
+  TrainNetwork(small_expected, small_data, small_data);
+  
+  // Occupy every thread of the pool so the large network's parallel epochs
+  // are run by this thread, which takes the older small network tasks first
+  ThreadPool &pool = ThreadPool::Shared();
+  std::atomic<unsigned> blocked(0);
+  std::atomic<bool> release(false);
+  TaskGroup blockers;
+  for (unsigned thread = 0; thread < pool.NumThreads(); ++thread) {
+    blockers.Run([&]() {
+      ++blocked;
+      while (!release) {
+        std::this_thread::yield();
+      }
+    });
+  }
+  while (blocked < pool.NumThreads()) {
+    std::this_thread::yield();
+  }
+  std::vector<FannNetwork> small_networks;
+  for (int task = 0; task < 4; ++task) {
+    small_networks.emplace_back(fann_copy(small_network.get()));
+  }
+  TaskGroup nested;
+  for (FannNetwork &network : small_networks) {
+    nested.Run([&]() { TrainNetwork(network, small_data, small_data); });
+  }
+  TrainNetwork(large_network, large_data, small_data);
+  release = true;
+  nested.Wait();
+  blockers.Wait();
+  
+  // Every network keeps the best weights of its own training
+  for (unsigned i = 0; i < large_network->total_connections; ++i) {
+    REQUIRE(large_network->weights[i] == large_expected->weights[i]);
+  }
+  for (FannNetwork &network : small_networks) {
+    for (unsigned i = 0; i < network->total_connections; ++i) {
+      REQUIRE(network->weights[i] == small_expected->weights[i]);
+    }
+  }
+}
+
+TEST_CASE("NativeTrainer", "[trainer]") {
+  auto data = FannTrainData(fann_create_train(203, 3, 2));
+  for (unsigned sample = 0; sample < 203; ++sample) {
+    data->input[sample][0] = 0.01f * sample - 1.0f;
+    data->input[sample][1] = 0.013f * (sample % 50);
+    data->input[sample][2] = (sample % 7) * 0.1f - 0.3f;
+    data->output[sample][0] = data->input[sample][0] > 0.3f ? 1.0f : 0.0f;
+    data->output[sample][1] = data->input[sample][2] > 0.0f ? 1.0f : 0.0f;
+  }
+  
+  // Epochs match fann_train_epoch for every algorithm, with more than one
+  // hidden layer and a number of samples that is not a multiple of the block
+  const fann_train_enum algorithms[] = {
+    FANN_TRAIN_INCREMENTAL, FANN_TRAIN_BATCH, FANN_TRAIN_RPROP,
+    FANN_TRAIN_QUICKPROP, FANN_TRAIN_SARPROP
+  };
+  for (fann_train_enum algorithm : algorithms) {
+    FannNetwork network(fann_create_standard(4, 3, 6, 4, 2));
+    fann_set_training_algorithm(network.get(), algorithm);
+    fann_set_activation_function_hidden(network.get(), FANN_SIGMOID_SYMMETRIC);
+    fann_randomize_weights(network.get(), -0.5f, 0.5f);
+    FannNetwork native_network(fann_copy(network.get()));
+    NativeTrainer trainer(native_network);
+    
+    for (int epoch = 0; epoch < 10; ++epoch) {
+      srand(epoch);
+      float error = fann_train_epoch(network.get(), data.get());
+      srand(epoch);
+      float native_error = trainer.TrainEpoch(data);
+      REQUIRE(native_error == Approx(error).epsilon(1e-4));
+      REQUIRE(native_network->num_bit_fail == network->num_bit_fail);
+    }
+    for (unsigned i = 0; i < network->total_connections; ++i) {
+      REQUIRE(native_network->weights[i] ==
+              Approx(network->weights[i]).epsilon(1e-3).margin(1e-5));
+    }
+  }
+}
+
+TEST_CASE("NativeTrainer parallel epochs", "[trainer]") {
+  const unsigned num_data = 3 * kTrainParallelSamples + 5;
+  auto data = FannTrainData(fann_create_train(num_data, 2, 1));
+  for (unsigned sample = 0; sample < num_data; ++sample) {
+    data->input[sample][0] = 2.0f * sample / num_data - 1.0f;
+    data->input[sample][1] = 0.013f * (sample % 50);
+    data->output[sample][0] = data->input[sample][0] > 0.3f ? 1.0f : 0.0f;
+  }
+  
+  // Epochs split across tasks are repeatable and close to FANN's
+  FannNetwork network(fann_create_standard(3, 2, 5, 1));
+  fann_set_training_algorithm(network.get(), FANN_TRAIN_RPROP);
+  fann_randomize_weights(network.get(), -0.5f, 0.5f);
+  FannNetwork native_network(fann_copy(network.get()));
+  FannNetwork repeat_network(fann_copy(network.get()));
+  NativeTrainer trainer(native_network);
+  NativeTrainer repeat_trainer(repeat_network);
+  for (int epoch = 0; epoch < 5; ++epoch) {
+    float error = fann_train_epoch(network.get(), data.get());
+    float native_error = trainer.TrainEpoch(data);
+    REQUIRE(repeat_trainer.TrainEpoch(data) == native_error);
+    REQUIRE(native_error == Approx(error).epsilon(1e-3));
+  }
+  for (unsigned i = 0; i < network->total_connections; ++i) {
+    REQUIRE(repeat_network->weights[i] == native_network->weights[i]);
+    REQUIRE(native_network->weights[i] ==
+            Approx(network->weights[i]).epsilon(1e-2).margin(1e-4));
+  }
+}
+
+TEST_CASE("Ensemble Predict", "[ensemble]") {
+  auto data = FannTrainData(fann_create_train(300, 3, 1));
+  for (unsigned sample = 0; sample < 300; ++sample) {
+    for (unsigned input = 0; input < 3; ++input) {
+      data->input[sample][input] = 0.01f * sample * (input + 1) - 1.0f;
+    }
+  }
+  
+  Ensemble ensemble;
+  Ensemble packed_ensemble(EnsembleStorage::kPacked);
+  std::vector<FannNetwork> networks;
+  for (int member = 0; member < 13; ++member) {
+    networks.emplace_back(fann_create_standard(3, 3, 5, 1));
+    fann_randomize_weights(networks.back().get(), -1.0f, 1.0f);
+    fann_set_activation_function_hidden(networks.back().get(),
+                                        FANN_SIGMOID_SYMMETRIC);
+    ensemble.Add(FannNetwork(fann_copy(networks.back().get())));
+    packed_ensemble.Add(FannNetwork(fann_copy(networks.back().get())));
+  }
+  REQUIRE(packed_ensemble.Size() == 13);
+  
+  std::vector<float> predictions(300 * ensemble.NumOutput());
+  ensemble.Predict(data->input, 300, predictions.data());
+  std::vector<std::vector<float>> rows = ensemble.Predict(data);
+  REQUIRE(rows.size() == 300);
+  for (unsigned sample = 0; sample < 300; ++sample) {
+    float expected = 0.0f;
+    for (auto &network : networks) {
+      expected += fann_run(network.get(), data->input[sample])[0];
+    }
+    expected /= networks.size();
+    REQUIRE(predictions[sample] == Approx(expected).margin(1e-6));
+    REQUIRE(rows[sample][0] == predictions[sample]);
+    REQUIRE(ensemble.Run(data->input[sample])[0] == predictions[sample]);
+    REQUIRE(packed_ensemble.Run(data->input[sample])[0] ==
+            predictions[sample]);
+  }
+  
+  // Packed members evaluate blocks of samples, including a partial last one
+  std::vector<float> packed_predictions(300 * ensemble.NumOutput());
+  packed_ensemble.Predict(data->input, 300, packed_predictions.data());
+  REQUIRE(packed_predictions == predictions);
+  
+  // Saved ensembles predict identically once loaded
+  static const char *ensemble_path = "test-ensemble.bin";
+  std::shared_ptr<void> _(nullptr, [](...){ remove(ensemble_path); });
+  REQUIRE(ensemble.Save(ensemble_path));
+  Ensemble loaded_ensemble;
+  REQUIRE(loaded_ensemble.Load(ensemble_path));
+  REQUIRE(loaded_ensemble.Size() == 13);
+  std::vector<float> loaded_predictions(300);
+  loaded_ensemble.Predict(data->input, 300, loaded_predictions.data());
+  REQUIRE(loaded_predictions == predictions);
+  
+  // Selected members predict as an ensemble of those networks alone
+  for (Ensemble *source : {&ensemble, &packed_ensemble, &loaded_ensemble}) {
+    Ensemble selected = source->Select({12, 3, 5});
+    REQUIRE(selected.Size() == 3);
+    for (unsigned sample = 0; sample < 300; sample += 7) {
+      float expected = 0.0f;
+      for (unsigned member : {12u, 3u, 5u}) {
+        expected += fann_run(networks[member].get(), data->input[sample])[0];
+      }
+      REQUIRE(selected.Run(data->input[sample])[0] ==
+              Approx(expected / 3).margin(1e-6));
+    }
+  }
+  
+  loaded_ensemble.Add(FannNetwork(fann_copy(networks.back().get())));
+  REQUIRE(loaded_ensemble.Size() == 14);
+  REQUIRE(!loaded_ensemble.Load(test_path));
+  
+  // Files are rejected when their layer sizes only account for the weights
+  // of a network once wrapped around to 32 bits
+  auto write_file = [&](std::vector<std::uint32_t> layers,
+                        std::uint32_t num_weights) {
+    std::vector<std::uint32_t> words = {
+      0, 1, static_cast<std::uint32_t>(layers.size() / 4), 1, num_weights,
+      0, 0, 0
+    };
+    std::memcpy(words.data(), "GBME", 4);
+    words.insert(words.end(), layers.begin(), layers.end());
+    words.resize((words.size() + 7) / 8 * 8 + num_weights);
+    std::ofstream file(ensemble_path, std::ofstream::binary);
+    file.write(reinterpret_cast<const char*>(words.data()),
+               words.size() * sizeof(std::uint32_t));
+  };
+  const std::uint32_t steepness = 0x3f000000;  // 0.5f
+  write_file({2, 1, FANN_SIGMOID, steepness}, 3);
+  REQUIRE(loaded_ensemble.Load(ensemble_path));
+  REQUIRE(loaded_ensemble.NumInput() == 2);
+  write_file({0x7fffffff, 2, FANN_SIGMOID, steepness,
+              2, 1, FANN_SIGMOID, steepness}, 3);
+  REQUIRE(!loaded_ensemble.Load(ensemble_path));
+  write_file({0xffffffff, 1, FANN_SIGMOID, steepness,
+              1, 1, FANN_SIGMOID, steepness}, 2);
+  REQUIRE(!loaded_ensemble.Load(ensemble_path));
+  write_file({2, 0, FANN_SIGMOID, steepness,
+              0, 1, FANN_SIGMOID, steepness}, 1);
+  REQUIRE(!loaded_ensemble.Load(ensemble_path));
+  REQUIRE(Ensemble().NumInput() == 0);
+  REQUIRE(Ensemble(EnsembleStorage::kPacked).NumOutput() == 0);
+  
+  // Packed storage rejects networks that do not share the first topology,
+  // including one with the same number of connections
+  REQUIRE(!packed_ensemble.Add(FannNetwork(fann_create_standard(3, 3, 6, 1))));
+  REQUIRE(!packed_ensemble.Add(FannNetwork(
+      fann_create_standard(4, 3, 1, 7, 1))));
+  FannNetwork other_activation(fann_copy(networks.back().get()));
+  fann_set_activation_function_output(other_activation.get(), FANN_LINEAR);
+  REQUIRE(!packed_ensemble.Add(std::move(other_activation)));
+  REQUIRE(packed_ensemble.Size() == 13);
+  REQUIRE(packed_ensemble.Run(data->input[0])[0] == predictions[0]);
+  
+  Ensemble mixed_ensemble;
+  REQUIRE(mixed_ensemble.Add(FannNetwork(fann_copy(networks.back().get()))));
+  REQUIRE(mixed_ensemble.Add(FannNetwork(fann_create_standard(3, 3, 6, 1))));
+  REQUIRE(!mixed_ensemble.Save(ensemble_path));
+}
+
+TEST_CASE("SelectEnsembleMembers", "[ensemble]") {
+  std::vector<float> targets = {0.0f, 1.0f, 0.0f, 1.0f};
+  std::vector<std::vector<float>> predictions = {
+    {0.3f, 1.3f, -0.2f, 0.8f},
+    {-0.3f, 0.7f, 0.3f, 1.3f},
+    {0.2f, 1.2f, 0.2f, 1.2f}
+  };
+  REQUIRE(EnsembleMeanSquaredError(predictions, {2}, targets) ==
+          Approx(0.04));
+  REQUIRE(EnsembleMeanSquaredError(predictions, {2, 0}, targets) ==
+          Approx(0.03125));
+  
+  // The best single member comes first, then the members that cancel out
+  // its errors until the error of the whole ensemble is reached
+  REQUIRE(SelectEnsembleMembers(predictions, targets, 3, 0.01f) ==
+          std::vector<unsigned>({2, 0, 1}));
+  REQUIRE(SelectEnsembleMembers(predictions, targets, 2, 0.01f) ==
+          std::vector<unsigned>({2, 0}));
+  REQUIRE(SelectEnsembleMembers(predictions, targets, 3, 10.0f) ==
+          std::vector<unsigned>({2}));
+}
+
+TEST_CASE("PredictionBatcher", "[batcher]") {
+  Ensemble ensemble;
+  for (int member = 0; member < 5; ++member) {
+    FannNetwork network(fann_create_standard(3, 3, 4, 2));
+    fann_randomize_weights(network.get(), -1.0f, 1.0f);
+    ensemble.Add(std::move(network));
+  }
+  
+  // Requests submitted concurrently are answered with their own predictions
+  std::vector<std::vector<float>> inputs(200, std::vector<float>(3));
+  for (unsigned sample = 0; sample < inputs.size(); ++sample) {
+    for (unsigned input = 0; input < 3; ++input) {
+      inputs[sample][input] = 0.01f * sample * (input + 1) - 1.0f;
+    }
+  }
+  PredictionBatcher batcher(ensemble, 16);
+  std::vector<std::future<std::vector<float>>> predictions(inputs.size());
+  TaskGroup clients;
+  for (unsigned client = 0; client < 4; ++client) {
+    clients.Run([&, client]() {
+      for (unsigned sample = client; sample < inputs.size(); sample += 4) {
+        predictions[sample] = batcher.Submit(inputs[sample]);
+      }
+    });
+  }
+  clients.Wait();
+  for (unsigned sample = 0; sample < inputs.size(); ++sample) {
+    REQUIRE(predictions[sample].get() == ensemble.Run(inputs[sample].data()));
+  }
+  
+  PredictionStats stats = batcher.Stats();
+  REQUIRE(stats.requests == inputs.size());
+  REQUIRE(stats.batches >= inputs.size() / 16);
+  REQUIRE(stats.batches <= inputs.size());
+  REQUIRE(stats.p50_latency_ms <= stats.p99_latency_ms);
+}
+
+TEST_CASE("Checkpoint", "[checkpoint]") {
+  static const char *checkpoint_path = "test-checkpoint.bin";
+  std::shared_ptr<void> _(nullptr, [](...){ remove(checkpoint_path); });
+  
+  FannNetworkDescriptor descriptor(4, 1);
+  descriptor.Mutate(1.0f, 0.5f, 1.0f);
+  EvolutionState state;
+  state.generation = 3;
+  state.best_ever_score = 0.25;
+  state.plan_seed = 17;
+  state.scored_descriptors.emplace_back(descriptor, 0.5);
+  state.complete_scores.push_back(true);
+  state.scored_descriptors.emplace_back(FannNetworkDescriptor(4, 1), 0.75);
+  state.complete_scores.push_back(false);
+  state.rng_state = GetDescriptorRngState();
+  
+  FannTrainData data = GenerateData(100);
+  std::vector<std::string> file_paths = {"a.dat", "b.dat"};
+  unsigned seed;
+  {
+    Checkpoint checkpoint(checkpoint_path, data, file_paths);
+    seed = checkpoint.Seed();
+    REQUIRE(seed != 0);
+    checkpoint.SetEvolutionState(4, state);
+    checkpoint.CompleteRun(2);
+  }
+  
+  Checkpoint checkpoint(checkpoint_path, data, file_paths);
+  REQUIRE(checkpoint.Seed() == seed);
+  REQUIRE(checkpoint.IsRunComplete(2));
+  REQUIRE(!checkpoint.IsRunComplete(4));
+  EvolutionState loaded_state;
+  REQUIRE(checkpoint.GetEvolutionState(4, loaded_state));
+  REQUIRE(loaded_state.generation == 3);
+  REQUIRE(loaded_state.best_ever_score == 0.25);
+  REQUIRE(loaded_state.plan_seed == 17);
+  REQUIRE(loaded_state.rng_state == state.rng_state);
+  REQUIRE(loaded_state.scored_descriptors.size() == 2);
+  REQUIRE(loaded_state.scored_descriptors[0].first == descriptor);
+  REQUIRE(loaded_state.scored_descriptors[0].second == 0.5);
+  REQUIRE(loaded_state.scored_descriptors[1].second == 0.75);
+  REQUIRE(loaded_state.complete_scores == state.complete_scores);
+  
+  // Progress for a different data set is discarded, including one with the
+  // same number of samples or loaded from other files
+  REQUIRE(!Checkpoint(checkpoint_path, GenerateData(99),
+                      file_paths).IsRunComplete(2));
+  FannTrainData other_data = GenerateData(100);
+  other_data->input[7][1] += 1.0f;
+  REQUIRE(!Checkpoint(checkpoint_path, other_data,
+                      file_paths).IsRunComplete(2));
+  REQUIRE(!Checkpoint(checkpoint_path, data,
+                      {"a.dat", "c.dat"}).IsRunComplete(2));
+  REQUIRE(!Checkpoint(checkpoint_path, data, {"a.dat"}).IsRunComplete(2));
+  REQUIRE(Checkpoint(checkpoint_path, data, file_paths).IsRunComplete(2));
+}
@@ -0,0 +1,199 @@
+/*
+  threadpool.cc
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+
+// Identifies the pool and queue owned by the current thread (if any)
+thread_local static ThreadPool *worker_pool = nullptr;
+thread_local static unsigned worker_queue = 0;
+
+ThreadPool::ThreadPool(unsigned num_threads)
+    : next_queue_(0), pending_tasks_(0), stop_(false) {
+  if (num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  
+  queues_.reserve(num_threads);
+  for (unsigned queue = 0; queue < num_threads; ++queue) {
+    queues_.emplace_back(new TaskQueue());
+  }
+  threads_.reserve(num_threads);
+  for (unsigned queue = 0; queue < num_threads; ++queue) {
+    threads_.emplace_back(&ThreadPool::WorkerLoop, this, queue);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    stop_ = true;
+  }
+  sleep_condition_.notify_all();
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+  
+  // Workers keep their own tasks local, other threads distribute round robin
+  unsigned queue = worker_pool == this
+      ? worker_queue
+      : next_queue_++ % static_cast<unsigned>(queues_.size());
+  
+  ++pending_tasks_;
+  {
+    std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+    queues_[queue]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+  }
+  sleep_condition_.notify_one();
+}
+
+bool ThreadPool::RunPendingTask() {
+  std::function<void()> task;
+  
+  bool found = worker_pool == this
+      ? PopTask(worker_queue, task) || StealTask(worker_queue + 1, task)
+      : StealTask(next_queue_++, task);
+  if (found) {
+    task();
+  }
+  
+  return found;
+}
+
+unsigned ThreadPool::NumThreads() const {
+  return static_cast<unsigned>(threads_.size());
+}
+
+ThreadPool& ThreadPool::Shared() {
+  static ThreadPool pool;
+  return pool;
+}
+
+bool ThreadPool::PopTask(unsigned queue, std::function<void()> &task) {
+  std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+  if (queues_[queue]->tasks.empty()) {
+    return false;
+  }
+  
+  // Newest task first as its data is most likely still in cache
+  task = std::move(queues_[queue]->tasks.back());
+  queues_[queue]->tasks.pop_back();
+  --pending_tasks_;
+  
+  return true;
+}
+
+bool ThreadPool::StealTask(unsigned first_queue,
+                           std::function<void()> &task) {
+  const unsigned num_queues = static_cast<unsigned>(queues_.size());
+  
+  for (unsigned offset = 0; offset < num_queues; ++offset) {
+    unsigned queue = (first_queue + offset) % num_queues;
+    std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+    if (!queues_[queue]->tasks.empty()) {
+      
+      // Oldest task first as it is least likely to be wanted by its owner
+      task = std::move(queues_[queue]->tasks.front());
+      queues_[queue]->tasks.pop_front();
+      --pending_tasks_;
+      
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+void ThreadPool::WorkerLoop(unsigned queue) {
+  worker_pool = this;
+  worker_queue = queue;
+  
+  for (;;) {
+    if (RunPendingTask()) {
+      continue;
+    }
+    
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    sleep_condition_.wait(lock, [this]() {
+      return stop_ || pending_tasks_ > 0;
+    });
+    if (stop_ && pending_tasks_ == 0) {
+      return;
+    }
+  }
+}
+
+TaskGroup::TaskGroup(ThreadPool &pool) : pool_(pool), remaining_tasks_(0) {}
+
+TaskGroup::~TaskGroup() {
+  try {
+    Wait();
+  } catch (...) {}
+}
+
+void TaskGroup::Run(std::function<void()> task) {
+  ++remaining_tasks_;
+  pool_.Submit([this, task]() {
+    try {
+      task();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!exception_) {
+        exception_ = std::current_exception();
+      }
+    }
+    
+    // The lock keeps the group alive until the waiting thread is notified
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--remaining_tasks_ == 0) {
+      condition_.notify_all();
+    }
+  });
+}
+
+void TaskGroup::Wait() {
+  
+  // Help execute queued tasks rather than blocking a thread of the pool
+  while (remaining_tasks_ > 0) {
+    if (!pool_.RunPendingTask()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait_for(lock, std::chrono::milliseconds(1), [this]() {
+        return remaining_tasks_ == 0;
+      });
+    }
+  }
+  
+  std::exception_ptr exception;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::swap(exception, exception_);
+  }
+  if (exception) {
+    std::rethrow_exception(exception);
+  }
+}
@@ -0,0 +1,125 @@
+/*
+  threadpool.h
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+  \rst
+  A work-stealing pool of threads. Each worker owns a queue of tasks, taking
+  the most recently submitted task from its own queue and stealing the oldest
+  task from other queues when its own is empty. Tasks are normally submitted
+  through a ``TaskGroup`` so their completion can be awaited.
+  \endrst
+*/
+class ThreadPool {
+ public:
+  /** Create a pool with a number of threads (zero uses every hardware thread). */
+  explicit ThreadPool(unsigned num_threads = 0);
+  
+  /** Finish all submitted tasks and stop the threads. */
+  ~ThreadPool();
+  
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  
+  /** Queue a task for execution. */
+  void Submit(std::function<void()> task);
+  
+  /** Execute a single queued task on the calling thread if one is available. */
+  bool RunPendingTask();
+  
+  /** Number of threads in the pool. */
+  unsigned NumThreads() const;
+  
+  /** Pool shared by the whole pipeline with a thread for each hardware thread. */
+  static ThreadPool& Shared();
+  
+ private:
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+  
+  bool PopTask(unsigned queue, std::function<void()> &task);
+  bool StealTask(unsigned first_queue, std::function<void()> &task);
+  void WorkerLoop(unsigned queue);
+  
+  std::vector<std::unique_ptr<TaskQueue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<unsigned> next_queue_;
+  std::atomic<unsigned> pending_tasks_;
+  std::mutex sleep_mutex_;
+  std::condition_variable sleep_condition_;
+  bool stop_;
+};
+
+/**
+  \rst
+  A set of tasks executed by a ``ThreadPool`` that can be waited on together.
+  Waiting threads execute queued tasks rather than blocking, so groups can be
+  nested inside tasks without exhausting the pool. The first exception thrown
+  by a task is rethrown by ``Wait``.
+  
+  ***Example**::
+  
+    TaskGroup group;
+    for (unsigned item = 0; item < items.size(); ++item) {
+      group.Run([&, item]() { Process(items[item]); });
+    }
+    group.Wait();
+  \endrst
+*/
+class TaskGroup {
+ public:
+  /** Create a group that submits tasks to ``pool``. */
+  explicit TaskGroup(ThreadPool &pool = ThreadPool::Shared());
+  
+  /** Wait for outstanding tasks, discarding any exception they raised. */
+  ~TaskGroup();
+  
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+  
+  /** Submit a task belonging to the group. */
+  void Run(std::function<void()> task);
+  
+  /** Wait for every task in the group to complete. */
+  void Wait();
+  
+ private:
+  ThreadPool &pool_;
+  std::atomic<unsigned> remaining_tasks_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::exception_ptr exception_;
+};
+
+#endif // THREADPOOL_H_
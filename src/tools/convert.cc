@@ -0,0 +1,52 @@
+/*
+  convert.cc
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fann.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "./../data.h"
+#include "./../fann_types.h"
+
+/** Converts FANN formatted data files into a single binary data set file. */
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cout << "Usage: convert output.bin datafile1 datafile2 ..."
+              << std::endl;
+    return 0;
+  }
+  
+  std::vector<std::string> file_paths(argv + 2, argv + argc);
+  FannTrainData data = LoadTrainData(file_paths);
+  if (!data) {
+    std::cout << "Failed to load data files" << std::endl;
+    return 1;
+  }
+  if (!WriteBinaryTrainData(argv[1], data)) {
+    std::cout << "Failed to write " << argv[1] << std::endl;
+    return 1;
+  }
+  std::cout << "Converted " << fann_length_train_data(data.get())
+            << " samples" << std::endl;
+  
+  return 0;
+}
@@ -0,0 +1,408 @@
+/*
+  serve.cc
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./../batcher.h"
+#include "./../data.h"
+#include "./../ensemble.h"
+#include "./../fann_types.h"
+
+static std::atomic<bool> stop_requested(false);
+static int listen_fd = -1;
+
+/** Reads lines from a file descriptor. */
+class LineReader {
+ public:
+  explicit LineReader(int fd) : fd_(fd) {}
+  
+  bool ReadLine(std::string &line) {
+    for (;;) {
+      std::size_t end = buffer_.find('\n');
+      if (end != std::string::npos) {
+        line = buffer_.substr(0, end);
+        buffer_.erase(0, end + 1);
+        return true;
+      }
+      char chunk[4096];
+      ssize_t length = read(fd_, chunk, sizeof(chunk));
+      if (length <= 0) {
+        line.swap(buffer_);
+        buffer_.clear();
+        return !line.empty();
+      }
+      buffer_.append(chunk, static_cast<std::size_t>(length));
+    }
+  }
+  
+ private:
+  int fd_;
+  std::string buffer_;
+};
+
+/** Writes a whole string to a file descriptor. */
+static bool WriteAll(int fd, const std::string &text) {
+  std::size_t written = 0;
+  while (written < text.size()) {
+    ssize_t length = write(fd, text.data() + written, text.size() - written);
+    if (length <= 0) {
+      return false;
+    }
+    written += static_cast<std::size_t>(length);
+  }
+  return true;
+}
+
+static std::string FormatStats(const PredictionStats &stats) {
+  std::ostringstream text;
+  text << "{\"requests\": " << stats.requests
+       << ", \"batches\": " << stats.batches
+       << ", \"mean_batch_size\": "
+       << (stats.batches ? static_cast<double>(stats.requests) / stats.batches
+                         : 0.0)
+       << ", \"p50_latency_ms\": " << stats.p50_latency_ms
+       << ", \"p99_latency_ms\": " << stats.p99_latency_ms
+       << ", \"requests_per_second\": " << stats.requests_per_second << "}";
+  return text.str();
+}
+
+/**
+  Serves the line protocol on a connection. Each line holds the features of a
+  sample separated by whitespace and is answered by a line of outputs, or
+  "error: ..." for malformed requests; the line "stats" is answered with the
+  server counters. Requests are read ahead of responses so a client can
+  pipeline them into the same batch.
+*/
+static void ServeConnection(int in_fd, int out_fd,
+                            PredictionBatcher &batcher,
+                            unsigned num_input) {
+  struct Response {
+    std::future<std::vector<float>> prediction;
+    std::string text;  // Written instead of a prediction when set
+  };
+  std::deque<Response> responses;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool finished = false;
+  
+  std::thread writer([&]() {
+    bool open = true;
+    for (;;) {
+      Response response;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [&]() { return finished || !responses.empty(); });
+        if (responses.empty()) {
+          return;
+        }
+        response = std::move(responses.front());
+        responses.pop_front();
+      }
+      
+      std::string line = response.text;
+      if (line.empty()) {
+        std::ostringstream outputs;
+        for (float output : response.prediction.get()) {
+          outputs << (outputs.tellp() > 0 ? " " : "") << output;
+        }
+        line = outputs.str();
+      }
+      open = open && WriteAll(out_fd, line + "\n");
+    }
+  });
+  
+  LineReader reader(in_fd);
+  std::string line;
+  while (reader.ReadLine(line)) {
+    Response response;
+    if (line == "stats") {
+      response.text = FormatStats(batcher.Stats());
+    } else {
+      std::istringstream values(line);
+      std::vector<float> features;
+      float value;
+      while (values >> value) {
+        features.push_back(value);
+      }
+      if (features.empty()) {
+        continue;
+      }
+      if (features.size() != num_input || !values.eof()) {
+        response.text = "error: expected " + std::to_string(num_input) +
+            " numeric features";
+      } else {
+        response.prediction = batcher.Submit(std::move(features));
+      }
+    }
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    responses.push_back(std::move(response));
+    condition.notify_one();
+  }
+  
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+  }
+  condition.notify_one();
+  writer.join();
+}
+
+/** Accepts connections on a Unix domain socket until interrupted. */
+static int ServeSocket(const std::string &path,
+                       PredictionBatcher &batcher,
+                       unsigned num_input) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Socket path too long" << std::endl;
+    return 1;
+  }
+  std::strcpy(address.sun_path, path.c_str());
+  
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path.c_str());
+  if (listen_fd < 0 ||
+      bind(listen_fd, reinterpret_cast<sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(listen_fd, SOMAXCONN) != 0) {
+    std::cerr << "Failed to listen on " << path << std::endl;
+    return 1;
+  }
+  std::cerr << "Listening on " << path << std::endl;
+  
+  // Connections are kept in a list so each thread can flag its own entry
+  struct Connection {
+    int fd = -1;
+    std::atomic<bool> finished{false};
+    std::thread thread;
+  };
+  std::list<Connection> connections;
+  
+  // Joins the threads and closes the sockets of finished connections
+  auto reap_connections = [&connections]() {
+    for (auto connection = connections.begin();
+         connection != connections.end();) {
+      if (!connection->finished) {
+        ++connection;
+        continue;
+      }
+      connection->thread.join();
+      close(connection->fd);
+      connection = connections.erase(connection);
+    }
+  };
+  
+  while (!stop_requested) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    reap_connections();
+    if (fd < 0) {
+      continue;  // Interrupted
+    }
+    connections.emplace_back();
+    Connection &connection = connections.back();
+    connection.fd = fd;
+    connection.thread = std::thread([&connection, &batcher, num_input]() {
+      ServeConnection(connection.fd, connection.fd, batcher, num_input);
+      connection.finished = true;
+    });
+  }
+  
+  // Unblock connections still waiting for requests
+  for (Connection &connection : connections) {
+    shutdown(connection.fd, SHUT_RDWR);
+  }
+  for (Connection &connection : connections) {
+    connection.thread.join();
+    close(connection.fd);
+  }
+  close(listen_fd);
+  unlink(path.c_str());
+  
+  return 0;
+}
+
+/**
+  Stand-in for a client: sends the inputs of a data set over a number of
+  concurrent connections, waiting for each response before sending the next
+  request, and reports the latency seen by the clients.
+*/
+static int RunClient(const std::string &path,
+                     const std::string &data_path,
+                     unsigned num_connections) {
+  FannTrainData data = LoadTrainData({data_path});
+  if (!data) {
+    std::cerr << "Failed to load " << data_path << std::endl;
+    return 1;
+  }
+  
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  auto connect_socket = [&]() {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address),
+                           sizeof(address)) != 0) {
+      close(fd);
+      fd = -1;
+    }
+    return fd;
+  };
+  
+  std::vector<std::vector<double>> latencies(num_connections);
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> clients;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned client = 0; client < num_connections; ++client) {
+    clients.emplace_back([&, client]() {
+      int fd = connect_socket();
+      if (fd < 0) {
+        failed = true;
+        return;
+      }
+      LineReader reader(fd);
+      std::string response;
+      for (unsigned sample = client; sample < data->num_data;
+           sample += num_connections) {
+        std::ostringstream request;
+        for (unsigned input = 0; input < data->num_input; ++input) {
+          request << (input ? " " : "") << data->input[sample][input];
+        }
+        request << "\n";
+        
+        auto sent = std::chrono::steady_clock::now();
+        if (!WriteAll(fd, request.str()) || !reader.ReadLine(response)) {
+          failed = true;
+          break;
+        }
+        std::chrono::duration<double, std::milli> latency =
+            std::chrono::steady_clock::now() - sent;
+        latencies[client].push_back(latency.count());
+      }
+      close(fd);
+    });
+  }
+  for (std::thread &client : clients) {
+    client.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  
+  std::vector<double> all_latencies;
+  for (auto &client_latencies : latencies) {
+    all_latencies.insert(all_latencies.end(), client_latencies.begin(),
+                         client_latencies.end());
+  }
+  std::cout << "{\"client_requests\": " << all_latencies.size()
+            << ", \"client_p50_latency_ms\": "
+            << Percentile(all_latencies, 0.5)
+            << ", \"client_p99_latency_ms\": "
+            << Percentile(all_latencies, 0.99)
+            << ", \"client_requests_per_second\": "
+            << (all_latencies.size() / std::max(elapsed.count(), 1e-9))
+            << "}" << std::endl;
+  
+  // Report the server's view of the same requests
+  int fd = connect_socket();
+  std::string server_stats;
+  if (fd >= 0 && WriteAll(fd, "stats\n")) {
+    LineReader(fd).ReadLine(server_stats);
+    std::cout << server_stats << std::endl;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  
+  return failed ? 1 : 0;
+}
+
+/** Serves predictions of a saved ensemble over stdin or a Unix socket. */
+int main(int argc, char **argv) {
+  std::vector<std::string> args(argv + 1, argv + argc);
+  
+  // A peer closing its connection early must fail the write rather than end
+  // the process
+  signal(SIGPIPE, SIG_IGN);
+  
+  if (args.size() >= 3 && args[0] == "--client") {
+    unsigned num_connections = args.size() > 3
+        ? static_cast<unsigned>(std::max(std::stoi(args[3]), 1))
+        : 8;
+    return RunClient(args[1], args[2], num_connections);
+  }
+  if (args.empty() || (args.size() != 1 &&
+                       (args.size() != 3 || args[1] != "--socket"))) {
+    std::cout << "Usage: serve model.bin [--socket path]" << std::endl
+              << "       serve --client path datafile [connections]"
+              << std::endl;
+    return 0;
+  }
+  
+  auto start = std::chrono::steady_clock::now();
+  Ensemble ensemble;
+  if (!ensemble.Load(args[0])) {
+    std::cerr << "Failed to load " << args[0] << std::endl;
+    return 1;
+  }
+  std::chrono::duration<double, std::milli> load_time =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << "Loaded " << ensemble.Size() << " networks in "
+            << load_time.count() << " ms" << std::endl;
+  
+  int result = 0;
+  {
+    PredictionBatcher batcher(ensemble);
+    if (args.size() == 3) {
+      struct sigaction action = {};
+      action.sa_handler = [](int) {
+        stop_requested = true;
+        if (listen_fd >= 0) {
+          shutdown(listen_fd, SHUT_RDWR);
+        }
+      };
+      sigaction(SIGINT, &action, nullptr);
+      sigaction(SIGTERM, &action, nullptr);
+      result = ServeSocket(args[2], batcher, ensemble.NumInput());
+    } else {
+      ServeConnection(STDIN_FILENO, STDOUT_FILENO, batcher,
+                      ensemble.NumInput());
+    }
+    std::cerr << FormatStats(batcher.Stats()) << std::endl;
+  }
+  
+  return result;
+}
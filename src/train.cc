@@ -22,30 +22,70 @@
 
 #include <fann.h>
 
+#include <algorithm>
 #include <limits>
 #include <memory>
+#include <vector>
 
 #include "config.h"
+#include "inference.h"
+#include "profile.h"
+#include "trainer.h"
 
 float TrainNetwork(FannNetwork &network,
                    FannTrainData &training_data,
-                   FannTrainData &validation_data) {
+                   FannTrainData &validation_data,
+                   int *best_epoch) {
   
   unsigned num_connections = fann_get_total_connections(network.get());
+  fann_type *weights = network->weights;
+  
+  // Weights of the best network are copied straight from the weight array
+  // into a buffer owned by this call (i.e. not by the thread, as waiting on a
+  // parallel epoch can run other training tasks on this thread)
+  std::vector<fann_type> best_weights(num_connections);
+  bool best_weights_saved = false;
   
   float best_validation_error = std::numeric_limits<float>::max();
-  auto best_connections = std::make_unique<fann_connection[]>(num_connections);
   int epochs_since_best_error = 0;
   
+  // Validation uses the compiled kernels rather than fann_test_data
+  CompiledNetwork compiled(network);
+  
+  // Epochs run natively unless FANN is selected in the configuration
+  std::unique_ptr<NativeTrainer> trainer;
+  if (kTrainNative) {
+    trainer.reset(new NativeTrainer(network));
+  }
+  
   for (int epoch = 0; epoch < kTrainMaxEpochs; ++epoch) {
-    fann_train_epoch(network.get(), training_data.get());
-    float validation_error = fann_test_data(network.get(),
-                                            validation_data.get());
+    {
+      PROFILE_SCOPE(ProfilePhase::kTrainEpoch);
+      PROFILE_COUNT(ProfileCounter::kTrainSamples, training_data->num_data);
+      if (trainer) {
+        trainer->TrainEpoch(training_data);
+      } else {
+        fann_train_epoch(network.get(), training_data.get());
+      }
+    }
+    float validation_error;
+    {
+      PROFILE_SCOPE(ProfilePhase::kValidation);
+      PROFILE_COUNT(ProfileCounter::kValidationSamples,
+                    validation_data->num_data);
+      compiled.UpdateWeights(network);
+      validation_error = compiled.MeanSquaredError(validation_data);
+    }
     
     if (validation_error < best_validation_error) {
-      fann_get_connection_array(network.get(), best_connections.get());
+      PROFILE_SCOPE(ProfilePhase::kSnapshot);
+      std::copy(weights, weights + num_connections, best_weights.begin());
+      best_weights_saved = true;
       best_validation_error = validation_error;
       epochs_since_best_error = 0;
+      if (best_epoch) {
+        *best_epoch = epoch + 1;
+      }
     } else {
       // Early stopping
       if (++epochs_since_best_error >= kTrainEarlyStoppingCount) {
@@ -55,9 +95,10 @@ float TrainNetwork(FannNetwork &network,
   }
   
   // Restore parameters of the network with the lowest validation error
-  fann_set_weight_array(network.get(),
-                        best_connections.get(),
-                        num_connections);
+  if (best_weights_saved) {
+    PROFILE_SCOPE(ProfilePhase::kSnapshot);
+    std::copy(best_weights.begin(), best_weights.end(), weights);
+  }
   
   return best_validation_error;
 }
@@ -28,7 +28,8 @@
   \rst
   Trains a ``FannNetwork`` object using early stopping. Returns mean squared
   error (MSE) which is used as the loss function. Training and validation data
-  supplied are ``FannTrainData`` objects.
+  supplied are ``FannTrainData`` objects. The number of epochs trained to reach
+  the lowest validation error is stored in ``best_epoch`` when supplied.
 
   ***Example**::
 
@@ -37,6 +38,7 @@
 */
 float TrainNetwork(FannNetwork &network,
                    FannTrainData &training_data,
-                   FannTrainData &validation_data);
+                   FannTrainData &validation_data,
+                   int *best_epoch = nullptr);
 
 #endif // TRAIN_H_
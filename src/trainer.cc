@@ -0,0 +1,674 @@
+/*
+  trainer.cc
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "trainer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+#include "config.h"
+#include "fann_extension.h"
+#include "inference.h"
+#include "threadpool.h"
+
+const unsigned NativeTrainer::kBlockSize;
+
+// Derivatives of activation functions as computed by FANN's
+// fann_activation_derived, including its clipping of neuron values
+static void DeriveNeurons(fann_activationfunc_enum activation_function,
+                          fann_type steepness,
+                          const fann_type *values,
+                          const fann_type *sums,
+                          fann_type *derivatives,
+                          unsigned count) {
+  auto clip = [](fann_type value, fann_type min, fann_type max) {
+    return value < min ? min : (value > max ? max : value);
+  };
+  
+  const unsigned n = count;
+  switch (activation_function) {
+    case FANN_LINEAR:
+    case FANN_LINEAR_PIECE:
+    case FANN_LINEAR_PIECE_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) derivatives[s] = steepness;
+      break;
+    case FANN_SIGMOID:
+    case FANN_SIGMOID_STEPWISE:
+      for (unsigned s = 0; s < n; ++s) {
+        fann_type value = clip(values[s], 0.01f, 0.99f);
+        derivatives[s] = 2.0f * steepness * value * (1.0f - value);
+      }
+      break;
+    case FANN_SIGMOID_SYMMETRIC:
+    case FANN_SIGMOID_SYMMETRIC_STEPWISE:
+      for (unsigned s = 0; s < n; ++s) {
+        fann_type value = clip(values[s], -0.98f, 0.98f);
+        derivatives[s] = steepness * (1.0f - (value * value));
+      }
+      break;
+    case FANN_GAUSSIAN:
+      for (unsigned s = 0; s < n; ++s) {
+        derivatives[s] = -2.0f * sums[s] * values[s] * steepness * steepness;
+      }
+      break;
+    case FANN_GAUSSIAN_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) {
+        derivatives[s] = -2.0f * sums[s] * (values[s] + 1.0f) * steepness *
+            steepness;
+      }
+      break;
+    case FANN_ELLIOT:
+      for (unsigned s = 0; s < n; ++s) {
+        derivatives[s] = steepness * 1.0f / (2.0f * (1.0f + std::fabs(sums[s])) *
+                                             (1.0f + std::fabs(sums[s])));
+      }
+      break;
+    case FANN_ELLIOT_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) {
+        derivatives[s] = steepness * 1.0f / ((1.0f + std::fabs(sums[s])) *
+                                             (1.0f + std::fabs(sums[s])));
+      }
+      break;
+    case FANN_SIN_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) {
+        derivatives[s] = static_cast<fann_type>(
+            steepness * std::cos(static_cast<double>(steepness * sums[s])));
+      }
+      break;
+    case FANN_COS_SYMMETRIC:
+      for (unsigned s = 0; s < n; ++s) {
+        derivatives[s] = static_cast<fann_type>(
+            steepness * -std::sin(static_cast<double>(steepness * sums[s])));
+      }
+      break;
+    case FANN_SIN:
+      for (unsigned s = 0; s < n; ++s) {
+        derivatives[s] = static_cast<fann_type>(
+            steepness * std::cos(static_cast<double>(steepness * sums[s])) /
+            2.0f);
+      }
+      break;
+    case FANN_COS:
+      for (unsigned s = 0; s < n; ++s) {
+        derivatives[s] = static_cast<fann_type>(
+            steepness * -std::sin(static_cast<double>(steepness * sums[s])) /
+            2.0f);
+      }
+      break;
+    default:
+      // Threshold and stepwise gaussian functions cannot be trained
+      for (unsigned s = 0; s < n; ++s) derivatives[s] = 0;
+      break;
+  }
+}
+
+static bool IsSymmetric(fann_activationfunc_enum activation_function) {
+  return activation_function == FANN_LINEAR_PIECE_SYMMETRIC ||
+      activation_function == FANN_THRESHOLD_SYMMETRIC ||
+      activation_function == FANN_SIGMOID_SYMMETRIC ||
+      activation_function == FANN_SIGMOID_SYMMETRIC_STEPWISE ||
+      activation_function == FANN_ELLIOT_SYMMETRIC ||
+      activation_function == FANN_GAUSSIAN_SYMMETRIC ||
+      activation_function == FANN_SIN_SYMMETRIC ||
+      activation_function == FANN_COS_SYMMETRIC;
+}
+
+NativeTrainer::NativeTrainer(FannNetwork &network)
+    : ann_(network.get()), num_values_(0), num_neurons_(0), max_inputs_(0) {
+  
+  for (fann_layer *layer = ann_->first_layer + 1; layer != ann_->last_layer;
+       ++layer) {
+    fann_layer *previous_layer = layer - 1;
+    
+    // Every layer ends with a bias neuron
+    Layer trained;
+    trained.num_input = static_cast<unsigned>(
+        previous_layer->last_neuron - previous_layer->first_neuron) - 1;
+    trained.num_output = static_cast<unsigned>(
+        layer->last_neuron - layer->first_neuron) - 1;
+    trained.activation_function = layer->first_neuron->activation_function;
+    trained.activation_steepness = layer->first_neuron->activation_steepness;
+    trained.first_weight = layer->first_neuron->first_con;
+    trained.first_input = num_values_;
+    trained.first_output = num_neurons_;
+    
+    num_values_ += trained.num_input + 1;
+    num_neurons_ += trained.num_output;
+    max_inputs_ = std::max(max_inputs_, trained.num_input + 1);
+    layers_.push_back(trained);
+  }
+  num_values_ += layers_.back().num_output + 1;
+  
+  scratches_.resize(1);
+  ResizeScratch(scratches_.front());
+}
+
+float NativeTrainer::TrainEpoch(FannTrainData &data) {
+  fann_allocate_train_arrays(ann_);
+  
+  const unsigned num_data = fann_length_train_data(data.get());
+  
+#ifdef MULTITHREAD
+  // The number of tasks depends only on the number of samples so slopes
+  // are always added together in the same order
+  unsigned num_tasks = 1;
+  if (ann_->training_algorithm != FANN_TRAIN_INCREMENTAL) {
+    num_tasks = std::max(num_data / static_cast<unsigned>(
+        std::max(kTrainParallelSamples, 1)), 1u);
+  }
+  if (scratches_.size() < num_tasks) {
+    scratches_.resize(num_tasks);
+    for (Scratch &task_scratch : scratches_) {
+      ResizeScratch(task_scratch);
+    }
+  }
+#endif
+
+  Scratch &scratch = scratches_.front();
+  scratch.mse = 0.0f;
+  scratch.num_mse = 0;
+  scratch.num_bit_fail = 0;
+  if (ann_->training_algorithm == FANN_TRAIN_INCREMENTAL) {
+    for (unsigned sample = 0; sample < num_data; ++sample) {
+      Forward<1>(scratch, data->input + sample, 1);
+      Backward<1>(scratch, data->output + sample, 1);
+      UpdateWeightsIncremental(scratch);
+    }
+  } else {
+#ifdef MULTITHREAD
+    if (num_tasks > 1) {
+      
+      // Ranges start on a block so each block matches a single threaded epoch
+      auto first_sample = [&](unsigned task) {
+        if (task == num_tasks) {
+          return num_data;
+        }
+        uint64_t sample = uint64_t(num_data) * task / num_tasks;
+        return static_cast<unsigned>(sample - sample % kBlockSize);
+      };
+      TaskGroup tasks;
+      for (unsigned task = 0; task < num_tasks; ++task) {
+        tasks.Run([&, task]() {
+          Scratch &task_scratch = scratches_[task];
+          task_scratch.mse = 0.0f;
+          task_scratch.num_mse = 0;
+          task_scratch.num_bit_fail = 0;
+          std::fill(task_scratch.slopes.begin(), task_scratch.slopes.end(),
+                    0.0f);
+          TrainSamples(data, first_sample(task), first_sample(task + 1),
+                       task_scratch, task_scratch.slopes.data());
+        });
+      }
+      tasks.Wait();
+      
+      // Deterministic reduction in task order
+      fann_type *slopes = ann_->train_slopes;
+      for (unsigned i = 0; i < ann_->total_connections; ++i) {
+        fann_type slope = slopes[i];
+        for (unsigned task = 0; task < num_tasks; ++task) {
+          slope += scratches_[task].slopes[i];
+        }
+        slopes[i] = slope;
+      }
+      for (unsigned task = 1; task < num_tasks; ++task) {
+        scratch.mse += scratches_[task].mse;
+        scratch.num_mse += scratches_[task].num_mse;
+        scratch.num_bit_fail += scratches_[task].num_bit_fail;
+      }
+    } else {
+      TrainSamples(data, 0, num_data, scratch, ann_->train_slopes);
+    }
+#else
+    TrainSamples(data, 0, num_data, scratch, ann_->train_slopes);
+#endif
+  }
+  
+  ann_->MSE_value = scratch.mse;
+  ann_->num_MSE = scratch.num_mse;
+  ann_->num_bit_fail = scratch.num_bit_fail;
+  
+  switch (ann_->training_algorithm) {
+    case FANN_TRAIN_BATCH:
+      UpdateWeightsBatch(num_data);
+      break;
+    case FANN_TRAIN_RPROP:
+      UpdateWeightsRprop();
+      break;
+    case FANN_TRAIN_QUICKPROP:
+      UpdateWeightsQuickprop(num_data);
+      break;
+    case FANN_TRAIN_SARPROP:
+      UpdateWeightsSarprop();
+      ++ann_->sarprop_epoch;
+      break;
+    default:
+      break;
+  }
+  
+  return fann_get_MSE(ann_);
+}
+
+void NativeTrainer::ResizeScratch(Scratch &scratch) const {
+  scratch.values.resize(num_values_ * kBlockSize);
+  scratch.sums.resize(num_neurons_ * kBlockSize);
+  scratch.errors.resize(num_neurons_ * kBlockSize);
+  scratch.transposed_values.resize(max_inputs_ * kBlockSize);
+  scratch.slopes.resize(ann_->total_connections);
+}
+
+void NativeTrainer::TrainSamples(FannTrainData &data,
+                                 unsigned first_sample,
+                                 unsigned last_sample,
+                                 Scratch &scratch,
+                                 fann_type *slopes) {
+  for (unsigned sample = first_sample; sample < last_sample;
+       sample += kBlockSize) {
+    unsigned num_samples = std::min(kBlockSize, last_sample - sample);
+    Forward<kBlockSize>(scratch, data->input + sample, num_samples);
+    Backward<kBlockSize>(scratch, data->output + sample, num_samples);
+    UpdateSlopes<kBlockSize>(scratch, slopes, num_samples);
+  }
+}
+
+template <unsigned kSamples>
+void NativeTrainer::Forward(Scratch &scratch,
+                            fann_type **input,
+                            unsigned num_samples) {
+  
+  // Neuron values are stored neuron major so each step of the kernels
+  // operates on the same neuron across every sample
+  fann_type *values = scratch.values.data();
+  const unsigned num_input = layers_.front().num_input;
+  for (unsigned neuron = 0; neuron < num_input; ++neuron) {
+    for (unsigned s = 0; s < kSamples; ++s) {
+      values[neuron * kSamples + s] = s < num_samples ? input[s][neuron] : 0;
+    }
+  }
+  
+  for (const Layer &layer : layers_) {
+    const unsigned num_connections = layer.num_input + 1;
+    const fann_type *inputs = values + layer.first_input * kSamples;
+    fann_type *outputs = values + (layer.first_input + num_connections) *
+        kSamples;
+    fann_type *layer_sums = scratch.sums.data() +
+        layer.first_output * kSamples;
+    const fann_type *layer_weights = ann_->weights + layer.first_weight;
+    
+    // Bias neurons
+    std::fill_n(values + (layer.first_input + layer.num_input) * kSamples,
+                kSamples, 1.0f);
+    std::fill_n(outputs + layer.num_output * kSamples, kSamples, 1.0f);
+    
+    const fann_type steepness = layer.activation_steepness;
+    const fann_type max_sum = 150 / steepness;
+    for (unsigned neuron = 0; neuron < layer.num_output; ++neuron) {
+      const fann_type *weights = layer_weights + neuron * num_connections;
+      
+      // Accumulate in the same order as fann_run
+      fann_type *sums = layer_sums + neuron * kSamples;
+      std::fill_n(sums, kSamples, 0.0f);
+      unsigned i = num_connections & 3;
+      switch (i) {
+        case 3:
+          for (unsigned s = 0; s < kSamples; ++s) {
+            sums[s] += weights[2] * inputs[2 * kSamples + s];
+          }
+          // fall through
+        case 2:
+          for (unsigned s = 0; s < kSamples; ++s) {
+            sums[s] += weights[1] * inputs[1 * kSamples + s];
+          }
+          // fall through
+        case 1:
+          for (unsigned s = 0; s < kSamples; ++s) {
+            sums[s] += weights[0] * inputs[s];
+          }
+          // fall through
+        case 0:
+          break;
+      }
+      for (; i != num_connections; i += 4) {
+        const fann_type *block = inputs + i * kSamples;
+        for (unsigned s = 0; s < kSamples; ++s) {
+          sums[s] += weights[i] * block[s] +
+              weights[i + 1] * block[kSamples + s] +
+              weights[i + 2] * block[2 * kSamples + s] +
+              weights[i + 3] * block[3 * kSamples + s];
+        }
+      }
+      
+      for (unsigned s = 0; s < kSamples; ++s) {
+        fann_type sum = steepness * sums[s];
+        sums[s] = sum > max_sum ? max_sum : (sum < -max_sum ? -max_sum : sum);
+      }
+      ActivateNeurons(layer.activation_function, sums,
+                      outputs + neuron * kSamples, kSamples);
+    }
+  }
+}
+
+template <unsigned kSamples>
+void NativeTrainer::Backward(Scratch &scratch,
+                             fann_type **desired_output,
+                             unsigned num_samples) {
+  
+  // Errors of the output layer as computed by fann_compute_MSE
+  const Layer &output_layer = layers_.back();
+  const fann_type *output_values = scratch.values.data() +
+      (output_layer.first_input + output_layer.num_input + 1) * kSamples;
+  const fann_type *output_sums = scratch.sums.data() +
+      output_layer.first_output * kSamples;
+  fann_type *output_errors = scratch.errors.data() +
+      output_layer.first_output * kSamples;
+  const bool symmetric = IsSymmetric(output_layer.activation_function);
+  const bool tanh_error = ann_->train_error_function == FANN_ERRORFUNC_TANH;
+  for (unsigned s = 0; s < kSamples; ++s) {
+    for (unsigned neuron = 0; neuron < output_layer.num_output; ++neuron) {
+      const unsigned index = neuron * kSamples + s;
+      if (s >= num_samples) {
+        output_errors[index] = 0;
+        continue;
+      }
+      
+      fann_type diff = desired_output[s][neuron] - output_values[index];
+      if (symmetric) {
+        diff /= 2.0f;
+      }
+      scratch.mse += static_cast<float>(diff * diff);
+      if (std::fabs(diff) >= ann_->bit_fail_limit) {
+        ++scratch.num_bit_fail;
+      }
+      if (tanh_error) {
+        if (diff < -.9999999) {
+          diff = -17.0f;
+        } else if (diff > .9999999) {
+          diff = 17.0f;
+        } else {
+          diff = static_cast<fann_type>(std::log((1.0 + diff) / (1.0 - diff)));
+        }
+      }
+      
+      fann_type derivative;
+      DeriveNeurons(output_layer.activation_function,
+                    output_layer.activation_steepness,
+                    output_values + index, output_sums + index,
+                    &derivative, 1);
+      output_errors[index] = derivative * diff;
+      ++scratch.num_mse;
+    }
+  }
+  
+  // Propagate errors to each hidden layer as fann_backpropagate_MSE does
+  for (unsigned layer = static_cast<unsigned>(layers_.size()) - 1; layer > 0;
+       --layer) {
+    const Layer &current = layers_[layer];
+    const Layer &previous = layers_[layer - 1];
+    const unsigned num_connections = current.num_input + 1;
+    const fann_type *weights = ann_->weights + current.first_weight;
+    const fann_type *errors = scratch.errors.data() +
+        current.first_output * kSamples;
+    fann_type *previous_errors = scratch.errors.data() +
+        previous.first_output * kSamples;
+    
+    std::fill_n(previous_errors, current.num_input * kSamples, 0.0f);
+    for (unsigned neuron = 0; neuron < current.num_output; ++neuron) {
+      const fann_type *neuron_weights = weights + neuron * num_connections;
+      const fann_type *neuron_errors = errors + neuron * kSamples;
+      for (unsigned i = 0; i < current.num_input; ++i) {
+        const fann_type weight = neuron_weights[i];
+        fann_type *input_errors = previous_errors + i * kSamples;
+        for (unsigned s = 0; s < kSamples; ++s) {
+          input_errors[s] += neuron_errors[s] * weight;
+        }
+      }
+    }
+    
+    const fann_type *previous_values = scratch.values.data() +
+        current.first_input * kSamples;
+    const fann_type *previous_sums = scratch.sums.data() +
+        previous.first_output * kSamples;
+    for (unsigned i = 0; i < current.num_input; ++i) {
+      fann_type derivatives[kSamples];
+      DeriveNeurons(previous.activation_function,
+                    previous.activation_steepness,
+                    previous_values + i * kSamples,
+                    previous_sums + i * kSamples,
+                    derivatives, kSamples);
+      fann_type *input_errors = previous_errors + i * kSamples;
+      for (unsigned s = 0; s < kSamples; ++s) {
+        input_errors[s] *= derivatives[s];
+      }
+    }
+  }
+}
+
+template <unsigned kSamples>
+void NativeTrainer::UpdateSlopes(Scratch &scratch,
+                                 fann_type *slopes,
+                                 unsigned num_samples) {
+  for (const Layer &layer : layers_) {
+    const unsigned num_connections = layer.num_input + 1;
+    const fann_type *inputs = scratch.values.data() +
+        layer.first_input * kSamples;
+    const fann_type *errors = scratch.errors.data() +
+        layer.first_output * kSamples;
+    fann_type *layer_slopes = slopes + layer.first_weight;
+    
+    // Sample major inputs let the slopes of a neuron be accumulated sample
+    // by sample (in FANN's order) with contiguous loads
+    fann_type *transposed = scratch.transposed_values.data();
+    for (unsigned i = 0; i < num_connections; ++i) {
+      for (unsigned s = 0; s < num_samples; ++s) {
+        transposed[s * num_connections + i] = inputs[i * kSamples + s];
+      }
+    }
+    
+    for (unsigned neuron = 0; neuron < layer.num_output; ++neuron) {
+      fann_type *neuron_slopes = layer_slopes + neuron * num_connections;
+      for (unsigned s = 0; s < num_samples; ++s) {
+        const fann_type error = errors[neuron * kSamples + s];
+        const fann_type *sample_inputs = transposed + s * num_connections;
+        for (unsigned i = 0; i < num_connections; ++i) {
+          neuron_slopes[i] += error * sample_inputs[i];
+        }
+      }
+    }
+  }
+}
+
+void NativeTrainer::UpdateWeightsIncremental(const Scratch &scratch) {
+  const float learning_rate = ann_->learning_rate;
+  const float learning_momentum = ann_->learning_momentum;
+  for (const Layer &layer : layers_) {
+    const unsigned num_connections = layer.num_input + 1;
+    const fann_type *inputs = scratch.values.data() + layer.first_input;
+    const fann_type *errors = scratch.errors.data() + layer.first_output;
+    fann_type *weights = ann_->weights + layer.first_weight;
+    fann_type *deltas = ann_->prev_weights_deltas + layer.first_weight;
+    
+    for (unsigned neuron = 0; neuron < layer.num_output; ++neuron) {
+      const fann_type error = errors[neuron] * learning_rate;
+      fann_type *neuron_weights = weights + neuron * num_connections;
+      fann_type *neuron_deltas = deltas + neuron * num_connections;
+      for (unsigned i = 0; i < num_connections; ++i) {
+        fann_type delta = error * inputs[i] +
+            learning_momentum * neuron_deltas[i];
+        neuron_weights[i] += delta;
+        neuron_deltas[i] = delta;
+      }
+    }
+  }
+}
+
+void NativeTrainer::UpdateWeightsBatch(unsigned num_data) {
+  fann_type *weights = ann_->weights;
+  fann_type *slopes = ann_->train_slopes;
+  const float epsilon = ann_->learning_rate / num_data;
+  for (unsigned i = 0; i < ann_->total_connections; ++i) {
+    weights[i] += slopes[i] * epsilon;
+    slopes[i] = 0.0f;
+  }
+}
+
+void NativeTrainer::UpdateWeightsRprop() {
+  fann_type *weights = ann_->weights;
+  fann_type *slopes = ann_->train_slopes;
+  fann_type *prev_steps = ann_->prev_steps;
+  fann_type *prev_slopes = ann_->prev_train_slopes;
+  const float increase_factor = ann_->rprop_increase_factor;
+  const float decrease_factor = ann_->rprop_decrease_factor;
+  const float delta_min = ann_->rprop_delta_min;
+  const float delta_max = ann_->rprop_delta_max;
+  
+  for (unsigned i = 0; i < ann_->total_connections; ++i) {
+    // The previous step may not be zero or training would stop
+    fann_type prev_step = std::max(prev_steps[i], 0.0001f);
+    fann_type slope = slopes[i];
+    fann_type next_step;
+    if (prev_slopes[i] * slope >= 0.0) {
+      next_step = std::min(prev_step * increase_factor, delta_max);
+    } else {
+      next_step = std::max(prev_step * decrease_factor, delta_min);
+      slope = 0;
+    }
+    
+    if (slope < 0) {
+      weights[i] -= next_step;
+      weights[i] = std::max(weights[i], -1500.0f);
+    } else {
+      weights[i] += next_step;
+      weights[i] = std::min(weights[i], 1500.0f);
+    }
+    
+    prev_steps[i] = next_step;
+    prev_slopes[i] = slope;
+    slopes[i] = 0.0f;
+  }
+}
+
+void NativeTrainer::UpdateWeightsQuickprop(unsigned num_data) {
+  fann_type *weights = ann_->weights;
+  fann_type *slopes = ann_->train_slopes;
+  fann_type *prev_steps = ann_->prev_steps;
+  fann_type *prev_slopes = ann_->prev_train_slopes;
+  const float epsilon = ann_->learning_rate / num_data;
+  const float decay = ann_->quickprop_decay;
+  const float mu = ann_->quickprop_mu;
+  const float shrink_factor = static_cast<float>(mu / (1.0 + mu));
+  
+  for (unsigned i = 0; i < ann_->total_connections; ++i) {
+    fann_type weight = weights[i];
+    fann_type prev_step = prev_steps[i];
+    fann_type slope = slopes[i] + decay * weight;
+    fann_type prev_slope = prev_slopes[i];
+    fann_type next_step = 0.0f;
+    
+    // The step must always be in direction opposite to the slope
+    if (prev_step > 0.001) {
+      if (slope > 0.0) {
+        next_step += epsilon * slope;
+      }
+      if (slope > (shrink_factor * prev_slope)) {
+        next_step += mu * prev_step;
+      } else {
+        next_step += prev_step * slope / (prev_slope - slope);
+      }
+    } else if (prev_step < -0.001) {
+      if (slope < 0.0) {
+        next_step += epsilon * slope;
+      }
+      if (slope < (shrink_factor * prev_slope)) {
+        next_step += mu * prev_step;
+      } else {
+        next_step += prev_step * slope / (prev_slope - slope);
+      }
+    } else {
+      next_step += epsilon * slope;
+    }
+    
+    prev_steps[i] = next_step;
+    weight += next_step;
+    weights[i] = weight > 1500 ? 1500 : (weight < -1500 ? -1500 : weight);
+    prev_slopes[i] = slope;
+    slopes[i] = 0.0f;
+  }
+}
+
+void NativeTrainer::UpdateWeightsSarprop() {
+  fann_type *weights = ann_->weights;
+  fann_type *slopes = ann_->train_slopes;
+  fann_type *prev_steps = ann_->prev_steps;
+  fann_type *prev_slopes = ann_->prev_train_slopes;
+  const float increase_factor = ann_->rprop_increase_factor;
+  const float decrease_factor = ann_->rprop_decrease_factor;
+  const float delta_min = 0.000001f;
+  const float delta_max = ann_->rprop_delta_max;
+  const float weight_decay_shift = ann_->sarprop_weight_decay_shift;
+  const float step_error_threshold_factor =
+      ann_->sarprop_step_error_threshold_factor;
+  const float step_error_shift = ann_->sarprop_step_error_shift;
+  const float temperature = ann_->sarprop_temperature;
+  const unsigned epoch = ann_->sarprop_epoch;
+  const float mse = fann_get_MSE(ann_);
+  const float rmse = static_cast<float>(std::sqrt(mse));
+  auto exp2 = [](double x) { return std::exp(0.69314718055994530942 * x); };
+  const fann_type weight_decay = static_cast<fann_type>(
+      exp2(-temperature * epoch + weight_decay_shift));
+  const fann_type step_error = static_cast<fann_type>(
+      exp2(-temperature * epoch + step_error_shift));
+  
+  // As in FANN the step is carried over to weights whose slope changes from
+  // or to zero
+  fann_type next_step = 0.0f;
+  for (unsigned i = 0; i < ann_->total_connections; ++i) {
+    fann_type prev_step = std::max(prev_steps[i], 0.000001f);
+    fann_type slope = -slopes[i] - weights[i] * weight_decay;
+    fann_type same_sign = prev_slopes[i] * slope;
+    
+    if (same_sign > 0.0) {
+      next_step = std::min(prev_step * increase_factor, delta_max);
+      if (slope < 0.0) {
+        weights[i] += next_step;
+      } else {
+        weights[i] -= next_step;
+      }
+    } else if (same_sign < 0.0) {
+      if (prev_step < step_error_threshold_factor * mse) {
+        next_step = prev_step * decrease_factor +
+            static_cast<float>(std::rand()) / RAND_MAX * rmse * step_error;
+      } else {
+        next_step = std::max(prev_step * decrease_factor, delta_min);
+      }
+      slope = 0.0f;
+    } else {
+      if (slope < 0.0) {
+        weights[i] += prev_step;
+      } else {
+        weights[i] -= prev_step;
+      }
+    }
+    
+    prev_steps[i] = next_step;
+    prev_slopes[i] = slope;
+    slopes[i] = 0.0f;
+  }
+}
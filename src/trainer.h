@@ -0,0 +1,136 @@
+/*
+  trainer.h
+  gbm_prediction_ann
+
+  Created by Adam Marcus on 21/08/2018.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRAINER_H_
+#define TRAINER_H_
+
+#include <fann.h>
+
+#include <vector>
+
+#include "fann_types.h"
+
+/**
+  \rst
+  Trains a ``FannNetwork`` with its training algorithm without calling into
+  FANN. Each epoch reproduces ``fann_train_epoch`` for the incremental, batch,
+  RPROP, Quickprop and SARPROP algorithms: sums, activations, derivatives,
+  the error function and updates are computed with FANN's formulas in the
+  same order, so trained weights match FANN to within floating point
+  tolerance. Weights and training state (slopes, steps and momentum) are
+  updated in place in the network, so epochs may be mixed with
+  ``fann_train_epoch`` and later FANN calls see the same state.
+  
+  Batch algorithms evaluate samples in blocks with each neuron computed for
+  every sample of the block at once, and every layer's weights are stored
+  contiguously, so the kernels vectorise. For ``MULTITHREAD`` builds, epochs
+  of batch algorithms with at least twice ``kTrainParallelSamples`` samples
+  are split into contiguous ranges evaluated by tasks on the shared
+  ``ThreadPool``. Each task accumulates the slopes and error of its range
+  separately and these are added together in order before the weights are
+  updated, so the result depends only on the number of samples and not on
+  the number of threads or the order tasks finish in (though it can differ
+  from a single threaded epoch by rounding). The network must be created with
+  ``fann_create_standard_array`` and use the same activation function and
+  steepness for every neuron of a layer, as for ``CompiledNetwork``.
+  
+  ***Example**::
+  
+    NativeTrainer trainer(network);
+    for (int epoch = 0; epoch < max_epochs; ++epoch) {
+      float mse = trainer.TrainEpoch(training_data);
+    }
+  \endrst
+*/
+class NativeTrainer {
+ public:
+  /** Number of samples evaluated together by batch algorithms. */
+  static const unsigned kBlockSize = 8;
+  
+  /** Prepare to train a network (which must outlive the trainer). */
+  explicit NativeTrainer(FannNetwork &network);
+  
+  /**
+    Train one epoch with the network's current training algorithm and
+    parameters, returning the mean squared error during the epoch as
+    ``fann_train_epoch`` does.
+  */
+  float TrainEpoch(FannTrainData &data);
+  
+ private:
+  struct Layer {
+    unsigned num_input;  // Excluding the bias
+    unsigned num_output;
+    fann_activationfunc_enum activation_function;
+    fann_type activation_steepness;
+    unsigned first_weight;  // Offset of the layer in the weight arrays
+    unsigned first_input;  // Offset of the input values in the scratch rows
+    unsigned first_output;  // Offset of the sums and errors in the rows
+  };
+  
+  // Scratch rows of kBlockSize samples for each neuron of every layer and the
+  // results of the samples evaluated by one task
+  struct Scratch {
+    std::vector<fann_type> values;  // Including the bias neuron of each layer
+    std::vector<fann_type> sums;
+    std::vector<fann_type> errors;
+    std::vector<fann_type> transposed_values;  // Sample major inputs of a layer
+    std::vector<fann_type> slopes;  // Only used by parallel epochs
+    float mse;
+    unsigned num_mse;
+    unsigned num_bit_fail;
+  };
+  
+  void ResizeScratch(Scratch &scratch) const;
+  
+  void TrainSamples(FannTrainData &data,
+                    unsigned first_sample,
+                    unsigned last_sample,
+                    Scratch &scratch,
+                    fann_type *slopes);
+  
+  template <unsigned kSamples>
+  void Forward(Scratch &scratch, fann_type **input, unsigned num_samples);
+  
+  template <unsigned kSamples>
+  void Backward(Scratch &scratch,
+                fann_type **desired_output,
+                unsigned num_samples);
+  
+  template <unsigned kSamples>
+  void UpdateSlopes(Scratch &scratch, fann_type *slopes, unsigned num_samples);
+  
+  void UpdateWeightsIncremental(const Scratch &scratch);
+  void UpdateWeightsBatch(unsigned num_data);
+  void UpdateWeightsRprop();
+  void UpdateWeightsQuickprop(unsigned num_data);
+  void UpdateWeightsSarprop();
+  
+  fann *ann_;
+  std::vector<Layer> layers_;
+  unsigned num_values_;
+  unsigned num_neurons_;
+  unsigned max_inputs_;
+  
+  // The first is used by single threaded epochs
+  std::vector<Scratch> scratches_;
+};
+
+#endif // TRAINER_H_